@@ -74,5 +74,9 @@ int main() {
   cout << collide(player, as, false) << endl; // kaboom!
   cout << collide(as, as, false) << endl; // traverse
 
+  // look up the player's row of the dispatch table once
+  auto player_collides = collide.bind(player);
+  cout << player_collides(as, false) << endl; // kaboom!
+
   return 0;
 }
@@ -8,8 +8,14 @@
 
 namespace detail {
 
-// Copied from Boost.
-template<typename Base, typename Derived>
+// std::is_final is C++14.
+template<typename T>
+struct is_final : std::integral_constant<bool, __is_final(T)> {
+};
+
+// Copied from Boost. It derives from Derived, thus final classes are
+// handled below.
+template<typename Base, typename Derived, bool = is_final<Derived>::value>
 struct is_virtual_base_of
 {
 #ifdef __BORLANDC__
@@ -46,6 +52,20 @@ struct is_virtual_base_of
   static const int value = sizeof(internal_struct_X) == sizeof(internal_struct_Y);
 };
 
+// A final class cannot be derived from. A base that Derived converts to -
+// thus neither ambiguous nor inaccessible - is virtual if it cannot be
+// static_cast to Derived.
+template<typename Base, typename Derived>
+struct is_virtual_base_of<Base, Derived, true>
+{
+  template<class D>
+  static std::false_type test(decltype(static_cast<D*>(std::declval<Base*>())));
+  template<class D>
+  static std::true_type test(...);
+  static const int value =
+    std::is_convertible<Derived*, Base*>::value && decltype(test<Derived>(nullptr))::value;
+};
+
 template<class B, class D, bool is_virtual>
 struct cast_best;
 
@@ -54,7 +74,7 @@ struct cast_best<B, D, false> : cast_using_static_cast<B, D> {
 };
 
 template<class B, class D>
-struct cast_best<B, D, true> : cast_using_dynamic_cast<B, D> {
+struct cast_best<B, D, true> : cast_using_cached_offset<B, D> {
 };
 
 template<typename... Class>
@@ -92,6 +112,57 @@ struct extract_virtuals< virtuals<Head...> > {
   using type = virtuals<Head...>;
 };
 
+template<class Virtuals>
+struct arity;
+
+template<class... Class>
+struct arity< virtuals<Class...> > {
+  static const int value = sizeof...(Class);
+};
+
+// Everything a call needs besides the objects themselves: the slot in the
+// mmt and the stride in the dispatch table, for each virtual argument.
+// There is one instance per multi-method, at a fixed address, filled by
+// grouping_resolver::make_groups and read by linear<>. If all the calls
+// select the same specialization, 'direct' points to it, and the objects
+// are not looked at.
+template<int Arity>
+struct alignas(64) dispatch_data {
+  static_assert(Arity > 0, "multi-method must have at least one virtual argument");
+  int slots_strides[2 * Arity];
+  multi_method_base::void_function_pointer direct;
+};
+
+// Dispatch data of a multi-method using compare_dispatch. For each
+// virtual parameter: the mmt of each conforming class, and a copy of the
+// class's entry for the multi-method - multiplied by the stride, except
+// for the first parameter. Empty if there are more than 'size' classes.
+struct compare_keys {
+  static const int size = 4;
+  const mm_class::offset* tables[size];
+  mm_class::offset entries[size];
+  int count;
+};
+
+template<int Arity>
+struct alignas(64) compare_data {
+  static_assert(Arity > 0, "multi-method must have at least one virtual argument");
+  int slots_strides[2 * Arity];
+  compare_keys keys[Arity];
+  multi_method_base::void_function_pointer direct;
+};
+
+// The keys in a multi_method's dispatch data, for multi_method_base.
+template<int Arity>
+compare_keys* keys_of(dispatch_data<Arity>&) {
+  return nullptr;
+}
+
+template<int Arity>
+compare_keys* keys_of(compare_data<Arity>& data) {
+  return data.keys;
+}
+
 template<class Result, class Multi, class Method>
 struct extract_method_virtuals_;
 
@@ -142,6 +213,47 @@ struct remove_virtual<const virtual_<C>&> {
   using type = const C&;
 };
 
+constexpr bool all() {
+  return true;
+}
+
+template<typename... B>
+constexpr bool all(bool first, B... rest) {
+  return first && all(rest...);
+}
+
+// Whether an argument of static type A, passed for parameter P, fully
+// determines its part of the dispatch: true for non-virtual parameters,
+// and for objects of a final class.
+template<typename P, typename A>
+struct is_final_arg : std::true_type {
+};
+
+template<class C, typename A>
+struct is_final_arg<virtual_<C>&, A> : std::integral_constant<
+  bool,
+  std::is_base_of<C, typename std::decay<A>::type>::value && is_final<typename std::decay<A>::type>::value> {
+};
+
+template<class C, typename A>
+struct is_final_arg<const virtual_<C>&, A> : is_final_arg<virtual_<C>&, A> {
+};
+
+template<class... P>
+struct final_args {
+  template<typename... A>
+  struct check : std::integral_constant<
+    bool,
+    all(is_final_arg<P, A>::value...) &&
+    all(std::is_convertible<A&&, typename remove_virtual<P>::type>::value...)> {
+  };
+
+  template<typename... A>
+  struct apply : std::conditional<
+    sizeof...(A) == sizeof...(P), check<A...>, std::false_type>::type {
+  };
+};
+
 template<class... Class> struct mm_class_vector_of_;
 
 template<class First, class... Rest>
@@ -180,8 +292,14 @@ struct get_mm_table;
 template<>
 struct get_mm_table<true> {
   template<class C>
-  static const std::vector<mm_class::offset>& value(const C* obj) {
-    return *obj->_get_yomm11_ptbl();
+  static const mm_class::offset* value(const C* obj) {
+    return obj->_get_yomm11_ptbl();
+  }
+
+  // identifies the class of the object, for caching purposes
+  template<class C>
+  static const void* key(const C* obj) {
+    return obj->_get_yomm11_ptbl();
   }
 };
 
@@ -194,14 +312,14 @@ struct init_ptr<mm_class::base_list<Bases...>> : init_ptr<Bases...> { };
 template<>
 struct init_ptr<mm_class::base_list<>> {
   template<class This> static void init(This* p) {
-    p->selector::_yomm11_ptbl = &mm_class::of<This>::pc->mmt;
+    p->selector::_yomm11_ptbl = mm_class::of<This>::the().mmt.pin();
   }
 };
 
 template<class Base, class... Bases>
 struct init_ptr<Base, Bases...> {
   template<class This> static void init(This* p) {
-    p->Base::_yomm11_ptbl = &mm_class::of<This>::pc->mmt;
+    p->Base::_yomm11_ptbl = mm_class::of<This>::the().mmt.pin();
     init_ptr<Bases...>::init(p);
   }
 };
@@ -219,12 +337,130 @@ struct signature {
 
 template<>
 struct get_mm_table<false> {
-  using class_of_type = std::unordered_map<std::type_index, const std::vector<mm_class::offset>*>;
+  struct registration {
+    const std::type_info* type;
+    const mm_class::table* mmt;
+  };
+
+  using class_of_type = std::unordered_map<std::type_index, registration>;
   static class_of_type* class_of;
+
+  // Collision-free hash table, keyed on the address of the type_info,
+  // built by initialize() from class_of. An object whose type_info is
+  // not found there (e.g. it lives in another shared object) goes through
+  // class_of.
+  struct entry {
+    const std::type_info* key;
+    const mm_class::offset* mmt;
+  };
+
+  static entry* hash_table;
+  static std::uintptr_t hash_mult;
+  static int hash_shift;
+
+  static void make_hash_table();
+  static const mm_class::offset* slow_value(const std::type_info& ti);
+
+  static std::size_t hash(const std::type_info& ti) {
+    return (reinterpret_cast<std::uintptr_t>(&ti) * hash_mult) >> hash_shift;
+  }
+
   template<class C>
-  static const std::vector<mm_class::offset>& value(const C* obj) {
-    YOREL_MM_TRACE(std::cout << "foreign mm_class::of<" << typeid(*obj).name() << "> = " << (*class_of)[std::type_index(typeid(*obj))] << std::endl);
-    return *(*class_of)[std::type_index(typeid(*obj))];
+  static const mm_class::offset* value(const C* obj) {
+    const std::type_info& ti = typeid(*obj);
+    const entry& e = hash_table[hash(ti)];
+    const mm_class::offset* mmt = e.key == &ti ? e.mmt : slow_value(ti);
+    YOREL_MM_TRACE(std::cout << "foreign mm_class::of<" << ti.name() << "> = " << mmt << std::endl);
+    return mmt;
+  }
+
+  template<class C>
+  static const void* key(const C* obj) {
+    return &typeid(*obj);
+  }
+};
+
+// Foreign hierarchies can carry a small integer that identifies the class
+// of an object, see MM_FOREIGN_TAGGED_ROOT. initialize() maps the tags to
+// the mmts in a flat array.
+struct tag_table {
+  const mm_class::offset** mmts;
+  int size;
+  std::vector<std::pair<int, const mm_class::table*>>* classes;
+
+  void add(int tag, mm_class& pc);
+  void make();
+
+  static std::vector<tag_table*>* all;
+  static void make_all();
+};
+
+template<class Root>
+struct class_tag {
+  int value;
+  static tag_table table;
+};
+
+template<class Root>
+tag_table class_tag<Root>::table;
+
+template<class C, class T, class M>
+T get_tag(const C* obj, T M::* member) {
+  return obj->*member;
+}
+
+template<class C, class T, class M>
+T get_tag(const C* obj, T (M::* fun)() const) {
+  return (obj->*fun)();
+}
+
+template<class Class>
+struct is_tagged {
+  template<class C>
+  static auto test(const C* obj) -> decltype(_yomm11_class_tag_(obj), std::true_type());
+  static std::false_type test(...);
+  static const bool value = decltype(test((const Class*) nullptr))::value;
+};
+
+struct get_tagged_mm_table {
+  template<class C>
+  static const mm_class::offset* value(const C* obj) {
+    auto tag = _yomm11_class_tag_(obj);
+    const tag_table& table = decltype(tag)::table;
+
+    if (static_cast<unsigned>(tag.value) < static_cast<unsigned>(table.size) && table.mmts[tag.value]) {
+      return table.mmts[tag.value];
+    }
+
+    // unregistered tag
+    return get_mm_table<false>::value(obj);
+  }
+
+  template<class C>
+  static const void* key(const C* obj) {
+    return value(obj);
+  }
+};
+
+template<class Class>
+struct mm_table_of {
+  using type = typename std::conditional<
+    std::is_base_of<selector, Class>::value,
+    get_mm_table<true>,
+    typename std::conditional<
+      is_tagged<Class>::value,
+      get_tagged_mm_table,
+      get_mm_table<false>
+      >::type
+    >::type;
+};
+
+template<class Class>
+struct register_tag {
+  template<typename Tag>
+  register_tag(Tag tag) {
+    using root_tag = decltype(_yomm11_class_tag_((const Class*) nullptr));
+    root_tag::table.add(static_cast<int>(tag), mm_class::of<Class>::the());
   }
 };
 
@@ -310,18 +546,27 @@ struct multi_method_implementation : multi_method_base {
   using signature = R(typename remove_virtual<P>::type...);
   using virtuals = typename extract_virtuals<P...>::type;
 
-  multi_method_implementation(YOREL_MM_TRACE(const char* name)) :
-      multi_method_base(mm_class_vector_of<virtuals>::get() YOREL_MM_COMMA_TRACE(name)),
+  multi_method_implementation(
+      int* slots_strides YOREL_MM_COMMA_TRACE(const char* name), resolver resolve_with,
+      void_function_pointer* direct) :
+      multi_method_base(mm_class_vector_of<virtuals>::get(), slots_strides YOREL_MM_COMMA_TRACE(name), resolve_with, direct),
       dispatch_table(nullptr) {
   }
 
   template<class M> method_base* add_spec();
+  template<class M> void add_batch_spec();
+  void_function_pointer find_batch_spec(method_pointer_type target) const;
 
   virtual void_function_pointer* allocate_dispatch_table(int size);
   virtual void emit(method_base*, int i);
   virtual void emit_next(method_base*, method_base*);
 
   method_pointer_type* dispatch_table;
+  // batch specializations, by class of the objects they process
+  std::unordered_map<const mm_class*, void_function_pointer> batch_specs;
+  // same, by target of the specialization they replace; rebuilt when the
+  // method is resolved
+  std::unordered_map<method_pointer_type, void_function_pointer> batch_targets;
 };
 
 template<typename R, typename... P>
@@ -341,11 +586,33 @@ method_base* multi_method_implementation<R, P...>::add_spec() {
   return method;
 }
 
+// Returns the batch specialization that replaces the specialization that
+// 'target' belongs to, if any.
+template<typename R, typename... P>
+multi_method_base::void_function_pointer multi_method_implementation<R, P...>::find_batch_spec(method_pointer_type target) const {
+  auto iter = batch_targets.find(target);
+  return iter == batch_targets.end() ? nullptr : iter->second;
+}
+
 template<typename R, typename... P>
 multi_method_base::void_function_pointer* multi_method_implementation<R, P...>::allocate_dispatch_table(int size) {
   using namespace std;
   delete [] dispatch_table;
   dispatch_table = new method_pointer_type[size];
+
+  batch_targets.clear();
+
+  if (!batch_specs.empty()) {
+    for (auto method : methods) {
+      auto entry = static_cast<const method_entry*>(method);
+      auto iter = batch_specs.find(entry->args[0]);
+
+      if (iter != batch_specs.end()) {
+        batch_targets[entry->pm] = iter->second;
+      }
+    }
+  }
+
   return reinterpret_cast<void_function_pointer*>(dispatch_table);
 }
 
@@ -365,6 +632,23 @@ void multi_method_implementation<R, P...>::emit_next(method_base* method, method
       : static_cast<const method_entry*>(next)->pm;
 }
 
+// Entry point in the dispatch table for the first virtual argument.
+// When it is the only one, the mmt contains the target itself, thus
+// saving an indirection.
+template<bool Unary>
+struct first_entry {
+  static multi_method_base::void_function_pointer* value(const mm_class::offset& entry) {
+    return entry.ptr;
+  }
+};
+
+template<>
+struct first_entry<true> {
+  static multi_method_base::void_function_pointer* value(const mm_class::offset& entry) {
+    return const_cast<multi_method_base::void_function_pointer*>(&entry.pf);
+  }
+};
+
 template<int Dim, typename... P>
 struct linear;
 
@@ -372,10 +656,9 @@ template<typename P1, typename... P>
 struct linear<0, P1, P...> {
   template<typename A1, typename... A>
   static multi_method_base::void_function_pointer* value(
-      std::vector<int>::const_iterator slot_iter,
-      std::vector<int>::const_iterator step_iter,
+      const int* slots_strides,
       A1, A... args) {
-    return linear<0, P...>::value(slot_iter, step_iter, args...);
+    return linear<0, P...>::value(slots_strides, args...);
   }
 };
 
@@ -383,12 +666,13 @@ template<typename P1, typename... P>
 struct linear<0, virtual_<P1>&, P...> {
   template<typename A1, typename... A>
   static multi_method_base::void_function_pointer* value(
-      std::vector<int>::const_iterator slot_iter,
-      std::vector<int>::const_iterator step_iter,
+      const int* slots_strides,
       A1 arg, A... args) {
     return linear<1, P...>::value(
-        slot_iter + 1, step_iter + 1,
-        detail::get_mm_table<std::is_base_of<selector, P1>::value>::value(arg)[*slot_iter].ptr, args...);
+        slots_strides,
+        first_entry<arity<typename extract_virtuals<P...>::type>::value == 0>::value(
+            mm_table_of<P1>::type::value(arg)[slots_strides[0]]),
+        args...);
   }
 };
 
@@ -396,12 +680,13 @@ template<typename P1, typename... P>
 struct linear<0, const virtual_<P1>&, P...> {
   template<typename A1, typename... A>
   static multi_method_base::void_function_pointer* value(
-      std::vector<int>::const_iterator slot_iter,
-      std::vector<int>::const_iterator step_iter,
+      const int* slots_strides,
       A1 arg, A... args) {
     return linear<1, P...>::value(
-        slot_iter + 1, step_iter + 1,
-        detail::get_mm_table<std::is_base_of<selector, P1>::value>::value(arg)[*slot_iter].ptr, args...);
+        slots_strides,
+        first_entry<arity<typename extract_virtuals<P...>::type>::value == 0>::value(
+            mm_table_of<P1>::type::value(arg)[slots_strides[0]]),
+        args...);
   }
 };
 
@@ -409,11 +694,10 @@ template<int Dim, typename P1, typename... P>
 struct linear<Dim, P1, P...> {
   template<typename A1, typename... A>
   static multi_method_base::void_function_pointer* value(
-      std::vector<int>::const_iterator slot_iter,
-      std::vector<int>::const_iterator step_iter,
+      const int* slots_strides,
       multi_method_base::void_function_pointer* ptr,
       A1, A... args) {
-    return linear<Dim, P...>::value(slot_iter, step_iter, ptr, args...);
+    return linear<Dim, P...>::value(slots_strides, ptr, args...);
   }
 };
 
@@ -421,14 +705,13 @@ template<int Dim, typename P1, typename... P>
 struct linear<Dim, virtual_<P1>&, P...> {
   template<typename A1, typename... A>
   static multi_method_base::void_function_pointer* value(
-      std::vector<int>::const_iterator slot_iter,
-      std::vector<int>::const_iterator step_iter,
+      const int* slots_strides,
       multi_method_base::void_function_pointer* ptr,
       A1 arg, A... args) {
     YOREL_MM_TRACE(std::cout << " -> " << ptr);
     return linear<Dim + 1, P...>::value(
-        slot_iter + 1, step_iter + 1,
-        ptr + detail::get_mm_table<std::is_base_of<selector, P1>::value>::value(arg)[*slot_iter].index * *step_iter,
+        slots_strides,
+        ptr + mm_table_of<P1>::type::value(arg)[slots_strides[2 * Dim]].index * slots_strides[2 * Dim + 1],
         args...);
   }
 };
@@ -437,14 +720,13 @@ template<int Dim, typename P1, typename... P>
 struct linear<Dim, const virtual_<P1>&, P...> {
   template<typename A1, typename... A>
   static multi_method_base::void_function_pointer* value(
-      std::vector<int>::const_iterator slot_iter,
-      std::vector<int>::const_iterator step_iter,
+      const int* slots_strides,
       multi_method_base::void_function_pointer* ptr,
       A1 arg, A... args) {
     YOREL_MM_TRACE(std::cout << " -> " << ptr);
     return linear<Dim + 1, P...>::value(
-        slot_iter + 1, step_iter + 1,
-        ptr + detail::get_mm_table<std::is_base_of<selector, P1>::value>::value(arg)[*slot_iter].index * *step_iter,
+        slots_strides,
+        ptr + mm_table_of<P1>::type::value(arg)[slots_strides[2 * Dim]].index * slots_strides[2 * Dim + 1],
         args...);
   }
 };
@@ -452,14 +734,573 @@ struct linear<Dim, const virtual_<P1>&, P...> {
 template<int Dim>
 struct linear<Dim> {
   static multi_method_base::void_function_pointer* value(
-      std::vector<int>::const_iterator slot_iter,
-      std::vector<int>::const_iterator step_iter,
+      const int* slots_strides,
       multi_method_base::void_function_pointer* ptr) {
     YOREL_MM_TRACE(std::cout << " -> " << ptr << std::endl);
     return ptr;
   }
 };
 
+// The lookup of the policies that use dispatch_data.
+template<typename... P>
+struct linear_lookup {
+  template<int Arity, typename... A>
+  static multi_method_base::void_function_pointer* value(const dispatch_data<Arity>& data, A... args) {
+    return linear<0, P...>::value(data.slots_strides, args...);
+  }
+};
+
+// Position of 'table' among the keys, or -1. Unrolled, unused keys are
+// null.
+template<int K>
+struct compare_scan {
+  static int value(const compare_keys& keys, const mm_class::offset* table) {
+    return keys.tables[compare_keys::size - K] == table
+      ? compare_keys::size - K
+      : compare_scan<K - 1>::value(keys, table);
+  }
+};
+
+template<>
+struct compare_scan<0> {
+  static int value(const compare_keys&, const mm_class::offset*) {
+    return -1;
+  }
+};
+
+// The entry for the class whose mmt is 'table': found among the keys, or
+// else read from the mmt.
+inline const mm_class::offset& compare_first(
+    const int* slots_strides, const compare_keys& keys, const mm_class::offset* table) {
+  int k = compare_scan<compare_keys::size>::value(keys, table);
+  return k >= 0 ? keys.entries[k] : table[slots_strides[0]];
+}
+
+inline int compare_next(
+    const int* slots_strides, const compare_keys& keys, int dim, const mm_class::offset* table) {
+  int k = compare_scan<compare_keys::size>::value(keys, table);
+  return k >= 0 ? keys.entries[k].index : table[slots_strides[2 * dim]].index * slots_strides[2 * dim + 1];
+}
+
+// Same as linear<>, using the compare_keys of compare_dispatch.
+template<int Dim, typename... P>
+struct compare_linear;
+
+template<typename P1, typename... P>
+struct compare_linear<0, P1, P...> {
+  template<typename A1, typename... A>
+  static multi_method_base::void_function_pointer* value(
+      const int* slots_strides, const compare_keys* keys,
+      A1, A... args) {
+    return compare_linear<0, P...>::value(slots_strides, keys, args...);
+  }
+};
+
+template<typename P1, typename... P>
+struct compare_linear<0, virtual_<P1>&, P...> {
+  template<typename A1, typename... A>
+  static multi_method_base::void_function_pointer* value(
+      const int* slots_strides, const compare_keys* keys,
+      A1 arg, A... args) {
+    return compare_linear<1, P...>::value(
+        slots_strides, keys,
+        first_entry<arity<typename extract_virtuals<P...>::type>::value == 0>::value(
+            compare_first(slots_strides, keys[0], mm_table_of<P1>::type::value(arg))),
+        args...);
+  }
+};
+
+template<typename P1, typename... P>
+struct compare_linear<0, const virtual_<P1>&, P...> {
+  template<typename A1, typename... A>
+  static multi_method_base::void_function_pointer* value(
+      const int* slots_strides, const compare_keys* keys,
+      A1 arg, A... args) {
+    return compare_linear<1, P...>::value(
+        slots_strides, keys,
+        first_entry<arity<typename extract_virtuals<P...>::type>::value == 0>::value(
+            compare_first(slots_strides, keys[0], mm_table_of<P1>::type::value(arg))),
+        args...);
+  }
+};
+
+template<int Dim, typename P1, typename... P>
+struct compare_linear<Dim, P1, P...> {
+  template<typename A1, typename... A>
+  static multi_method_base::void_function_pointer* value(
+      const int* slots_strides, const compare_keys* keys,
+      multi_method_base::void_function_pointer* ptr,
+      A1, A... args) {
+    return compare_linear<Dim, P...>::value(slots_strides, keys, ptr, args...);
+  }
+};
+
+template<int Dim, typename P1, typename... P>
+struct compare_linear<Dim, virtual_<P1>&, P...> {
+  template<typename A1, typename... A>
+  static multi_method_base::void_function_pointer* value(
+      const int* slots_strides, const compare_keys* keys,
+      multi_method_base::void_function_pointer* ptr,
+      A1 arg, A... args) {
+    return compare_linear<Dim + 1, P...>::value(
+        slots_strides, keys,
+        ptr + compare_next(slots_strides, keys[Dim], Dim, mm_table_of<P1>::type::value(arg)),
+        args...);
+  }
+};
+
+template<int Dim, typename P1, typename... P>
+struct compare_linear<Dim, const virtual_<P1>&, P...> {
+  template<typename A1, typename... A>
+  static multi_method_base::void_function_pointer* value(
+      const int* slots_strides, const compare_keys* keys,
+      multi_method_base::void_function_pointer* ptr,
+      A1 arg, A... args) {
+    return compare_linear<Dim + 1, P...>::value(
+        slots_strides, keys,
+        ptr + compare_next(slots_strides, keys[Dim], Dim, mm_table_of<P1>::type::value(arg)),
+        args...);
+  }
+};
+
+template<int Dim>
+struct compare_linear<Dim> {
+  static multi_method_base::void_function_pointer* value(
+      const int* slots_strides, const compare_keys* keys,
+      multi_method_base::void_function_pointer* ptr) {
+    return ptr;
+  }
+};
+
+template<typename... P>
+struct virtual_keys;
+
+template<typename P1, typename... P>
+struct virtual_keys<P1, P...> {
+  template<typename A1, typename... A>
+  static void get(const void** keys, A1, A... args) {
+    virtual_keys<P...>::get(keys, args...);
+  }
+};
+
+template<typename P1, typename... P>
+struct virtual_keys<virtual_<P1>&, P...> {
+  template<typename A1, typename... A>
+  static void get(const void** keys, A1 arg, A... args) {
+    *keys = mm_table_of<P1>::type::key(arg);
+    virtual_keys<P...>::get(keys + 1, args...);
+  }
+};
+
+template<typename P1, typename... P>
+struct virtual_keys<const virtual_<P1>&, P...> {
+  template<typename A1, typename... A>
+  static void get(const void** keys, A1 arg, A... args) {
+    *keys = mm_table_of<P1>::type::key(arg);
+    virtual_keys<P...>::get(keys + 1, args...);
+  }
+};
+
+template<>
+struct virtual_keys<> {
+  static void get(const void**) {
+  }
+};
+
+// A call with the first argument fixed, see multi_method::bind(). The row
+// of the dispatch table that it selects is looked up once, only the
+// remaining virtual arguments are looked up at each call.
+
+template<typename R, typename... P>
+struct bound;
+
+template<typename R, typename P1, typename... P>
+struct bound<R, P1, P...> {
+  using first_type = typename remove_virtual<P1>::type;
+  using first_class = typename std::remove_reference<first_type>::type;
+  using method_pointer_type = R (*)(first_type, typename remove_virtual<P>::type...);
+
+  bound(const int* slots_strides, first_type first) :
+    slots_strides(slots_strides), first(&first),
+    row(mm_table_of<typename std::remove_cv<first_class>::type>::type::value(&first)[slots_strides[0]].ptr),
+    generation(multi_method_base::generation) {
+    // here rather than at class scope, because every multi_method names
+    // its bound type
+    static_assert(
+      !std::is_same<first_type, P1>::value,
+      "the first parameter must be virtual");
+    static_assert(
+      arity<typename extract_virtuals<P...>::type>::value > 0,
+      "bind() requires at least two virtual parameters");
+  }
+
+  R operator ()(typename remove_virtual<P>::type... args) const {
+    if (valid()) {
+      return reinterpret_cast<method_pointer_type>(*linear<1, P...>::value(slots_strides, row, &args...))(*first, args...);
+    }
+
+    return reinterpret_cast<method_pointer_type>(*linear<0, P1, P...>::value(slots_strides, first, &args...))(*first, args...);
+  }
+
+  bool valid() const { return generation == multi_method_base::generation; }
+
+  const int* slots_strides;
+  first_class* first;
+  multi_method_base::void_function_pointer* row;
+  std::size_t generation;
+};
+
+// Calls a binary multi-method for many pairs of objects, see
+// multi_method::for_each_pair(). The objects are sorted by row (first
+// argument) and by column (second argument) of the dispatch table, then
+// each cell is called for all the pairs it applies to in a tight loop.
+
+template<typename R, typename... P>
+struct pairwise;
+
+template<typename R, typename P1, typename P2, typename... E>
+struct pairwise<R, P1, P2, E...> {
+  using first_type = typename remove_virtual<P1>::type;
+  using second_type = typename remove_virtual<P2>::type;
+  using first_class = typename std::remove_cv<typename std::remove_reference<first_type>::type>::type;
+  using second_class = typename std::remove_cv<typename std::remove_reference<second_type>::type>::type;
+  using method_pointer_type = R (*)(first_type, second_type, typename remove_virtual<E>::type...);
+  using cell = multi_method_base::void_function_pointer;
+
+  static_assert(
+    !std::is_same<first_type, P1>::value && !std::is_same<second_type, P2>::value,
+    "the first two parameters must be virtual");
+  static_assert(
+    arity<typename extract_virtuals<E...>::type>::value == 0,
+    "only the first two parameters can be virtual");
+
+  template<typename Key, class Object>
+  using keyed = std::vector<std::pair<Key, Object>>;
+
+  template<typename Key, class Object>
+  static void sort(keyed<Key, Object>& objects) {
+    std::stable_sort(
+      objects.begin(), objects.end(),
+      [](const std::pair<Key, Object>& a, const std::pair<Key, Object>& b) {
+        return std::less<Key>()(a.first, b.first);
+      });
+  }
+
+  template<typename Key, class Object>
+  static typename keyed<Key, Object>::iterator end_of_run(
+      typename keyed<Key, Object>::iterator iter, typename keyed<Key, Object>::iterator last) {
+    auto key = iter->first;
+    while (iter != last && iter->first == key) {
+      ++iter;
+    }
+    return iter;
+  }
+
+  template<class Object>
+  static cell* row(const int* slots_strides, const Object& obj) {
+    return mm_table_of<first_class>::type::value(static_cast<const first_class*>(obj))[slots_strides[0]].ptr;
+  }
+
+  template<class Object>
+  static int column(const int* slots_strides, const Object& obj) {
+    return mm_table_of<second_class>::type::value(static_cast<const second_class*>(obj))[slots_strides[2]].index;
+  }
+
+  template<class I1, class I2, typename... X>
+  static void for_each_pair(const int* slots_strides, I1 first1, I1 last1, I2 first2, I2 last2, X&&... extras) {
+    using object1 = typename std::iterator_traits<I1>::value_type;
+    using object2 = typename std::iterator_traits<I2>::value_type;
+
+    keyed<cell*, object1> rows;
+    for (; first1 != last1; ++first1) {
+      rows.emplace_back(row(slots_strides, *first1), *first1);
+    }
+    sort(rows);
+
+    keyed<int, object2> columns;
+    for (; first2 != last2; ++first2) {
+      columns.emplace_back(column(slots_strides, *first2), *first2);
+    }
+    sort(columns);
+
+    const int stride = slots_strides[3];
+
+    for (auto row_iter = rows.begin(); row_iter != rows.end(); ) {
+      auto row_end = end_of_run<cell*, object1>(row_iter, rows.end());
+
+      for (auto column_iter = columns.begin(); column_iter != columns.end(); ) {
+        auto column_end = end_of_run<int, object2>(column_iter, columns.end());
+        auto method = reinterpret_cast<method_pointer_type>(row_iter->first[column_iter->first * stride]);
+
+        for (auto a = row_iter; a != row_end; ++a) {
+          for (auto b = column_iter; b != column_end; ++b) {
+            method(*a->second, *b->second, extras...);
+          }
+        }
+
+        column_iter = column_end;
+      }
+
+      row_iter = row_end;
+    }
+  }
+
+  template<class I, typename... X>
+  static void for_each_unordered_pair(const int* slots_strides, I first, I last, X&&... extras) {
+    using object = typename std::iterator_traits<I>::value_type;
+    using key = std::pair<cell*, int>;
+
+    keyed<key, object> objects;
+    for (; first != last; ++first) {
+      objects.emplace_back(key(row(slots_strides, *first), column(slots_strides, *first)), *first);
+    }
+    sort(objects);
+
+    std::vector<typename keyed<key, object>::iterator> runs;
+    for (auto iter = objects.begin(); iter != objects.end(); iter = end_of_run<key, object>(iter, objects.end())) {
+      runs.push_back(iter);
+    }
+    runs.push_back(objects.end());
+
+    const int stride = slots_strides[3];
+
+    for (std::size_t i = 0; i + 1 < runs.size(); ++i) {
+      for (std::size_t j = i; j + 1 < runs.size(); ++j) {
+        auto method = reinterpret_cast<method_pointer_type>(runs[i]->first.first[runs[j]->first.second * stride]);
+
+        for (auto a = runs[i]; a != runs[i + 1]; ++a) {
+          for (auto b = i == j ? a + 1 : runs[j]; b != runs[j + 1]; ++b) {
+            method(*a->second, *b->second, extras...);
+          }
+        }
+      }
+    }
+  }
+};
+
+// Buffers of type T, reused by the calls made in the same thread, so
+// that they allocate only while the buffers grow. A call made while the
+// thread's buffers are in use - e.g. from a specialization called by
+// for_each() - gets buffers of its own.
+
+template<class T>
+class scratch {
+ public:
+  scratch() : nested(reused().busy) {
+    if (nested) {
+      own.reset(new T);
+      p = own.get();
+    } else {
+      reused().busy = true;
+      p = &reused().buffers;
+    }
+  }
+
+  ~scratch() {
+    if (!nested) {
+      reused().busy = false;
+    }
+  }
+
+  scratch(const scratch&) = delete;
+  scratch& operator =(const scratch&) = delete;
+
+  T& operator *() const { return *p; }
+  T* operator ->() const { return p; }
+
+ private:
+  struct slot {
+    T buffers;
+    bool busy{false};
+  };
+
+  static slot& reused() {
+    static thread_local slot the;
+    return the;
+  }
+
+  bool nested;
+  std::unique_ptr<T> own;
+  T* p;
+};
+
+// Calls a unary multi-method for each object in a range, see
+// multi_method::for_each(). The objects are bucketed by target function
+// (a counting sort), then each bucket is processed in a tight loop, or
+// passed to the batch specialization that replaces the target, if any.
+
+template<typename R, typename... P>
+struct batch;
+
+template<typename R, typename P1, typename... E>
+struct batch<R, P1, E...> {
+  using first_type = typename remove_virtual<P1>::type;
+  using first_pointer = typename std::remove_reference<first_type>::type*;
+  using first_class = typename std::remove_cv<typename std::remove_reference<first_type>::type>::type;
+  using method_pointer_type = R (*)(first_type, typename remove_virtual<E>::type...);
+  using batch_pointer_type = void (*)(first_pointer*, std::size_t, typename remove_virtual<E>::type...);
+  using implementation = multi_method_implementation<R, P1, E...>;
+
+  static_assert(
+    !std::is_same<first_type, P1>::value,
+    "the first parameter must be virtual");
+  static_assert(
+    arity<typename extract_virtuals<E...>::type>::value == 0,
+    "only the first parameter can be virtual");
+
+  struct buffers {
+    std::vector<first_pointer> objects;
+    std::vector<first_pointer> sorted;
+    std::vector<method_pointer_type> bucket_target;
+    std::vector<std::size_t> bucket_start;
+    std::vector<std::size_t> bucket_end;
+    std::vector<std::size_t> bucket_index;
+  };
+
+  template<class I, typename... X>
+  static void for_each(const implementation* impl, const int* slots_strides, I first, I last, X&&... extras) {
+    scratch<buffers> b;
+    auto& objects = b->objects;
+    auto& sorted = b->sorted;
+    auto& bucket_target = b->bucket_target;
+    auto& bucket_start = b->bucket_start;
+    auto& bucket_end = b->bucket_end;
+    auto& bucket_index = b->bucket_index;
+    objects.clear();
+    bucket_target.clear();
+    bucket_start.clear();
+    bucket_index.clear();
+
+    // find the target of each object and count the objects per target;
+    // there are few targets, and runs of objects often share one
+    method_pointer_type last_target = nullptr;
+    std::size_t last_bucket = 0;
+
+    for (; first != last; ++first) {
+      first_pointer obj = *first;
+      method_pointer_type target = reinterpret_cast<method_pointer_type>(
+        mm_table_of<first_class>::type::value(obj)[slots_strides[0]].pf);
+
+      if (target != last_target || bucket_target.empty()) {
+        last_bucket = std::find(bucket_target.begin(), bucket_target.end(), target) - bucket_target.begin();
+
+        if (last_bucket == bucket_target.size()) {
+          bucket_target.push_back(target);
+          bucket_start.push_back(0);
+        }
+
+        last_target = target;
+      }
+
+      ++bucket_start[last_bucket];
+      bucket_index.push_back(last_bucket);
+      objects.push_back(obj);
+    }
+
+    // turn the counts into start positions, then place the objects
+    std::size_t start = 0;
+
+    for (auto& count : bucket_start) {
+      std::size_t n = count;
+      count = start;
+      start += n;
+    }
+
+    sorted.resize(objects.size());
+    bucket_end.assign(bucket_start.begin(), bucket_start.end());
+
+    for (std::size_t i = 0; i < objects.size(); ++i) {
+      sorted[bucket_end[bucket_index[i]]++] = objects[i];
+    }
+
+    for (std::size_t bucket = 0; bucket < bucket_target.size(); ++bucket) {
+      method_pointer_type target = bucket_target[bucket];
+      auto batch_spec = impl ? impl->find_batch_spec(target) : nullptr;
+
+      if (batch_spec) {
+        reinterpret_cast<batch_pointer_type>(batch_spec)(
+          sorted.data() + bucket_start[bucket], bucket_end[bucket] - bucket_start[bucket], extras...);
+      } else {
+        auto end = sorted.begin() + bucket_end[bucket];
+
+        for (auto iter = sorted.begin() + bucket_start[bucket]; iter != end; ++iter) {
+          target(**iter, extras...);
+        }
+      }
+    }
+  }
+};
+
+// Number of threads used to process n items.
+unsigned parallel_workers(std::size_t n);
+
+// Calls body(context, worker, begin, end) for chunks of [0, n), in
+// 'workers' threads including the caller's. The other threads belong to
+// a pool that is started on first use and lives until the program ends.
+// Each thread takes the next chunk from a shared cursor as soon as it is
+// done with the previous one, thus threads that get cheap items process
+// more of them. After an exception the remaining chunks are skipped, and
+// the first exception is rethrown once all the threads are done. A call
+// made while the pool is busy runs in the caller's thread only.
+using parallel_body = void (*)(void* context, unsigned worker, std::size_t begin, std::size_t end);
+void run_parallel_chunks(std::size_t n, unsigned workers, parallel_body body, void* context);
+
+template<class Body>
+void parallel_chunks(std::size_t n, unsigned workers, Body body) {
+  run_parallel_chunks(
+    n, workers,
+    [](void* context, unsigned worker, std::size_t begin, std::size_t end) {
+      (*static_cast<Body*>(context))(worker, begin, end);
+    },
+    &body);
+}
+
+// Adapts a batch specialization to the pointers to the virtual
+// parameter's class that batch<>::for_each() passes.
+
+template<class M, class Base, typename Sig>
+struct batch_wrapper;
+
+template<class M, class Base, class C, typename... E>
+struct batch_wrapper<M, Base, void(span<C*>, E...)> {
+  using target_class = typename std::remove_cv<C>::type;
+
+  static void body(Base** objects, std::size_t n, E... extras) {
+    scratch<std::vector<C*>> targets;
+    targets->resize(n);
+
+    for (std::size_t i = 0; i < n; ++i) {
+      (*targets)[i] = &cast<typename std::remove_cv<Base>::type, target_class>::value(*objects[i]);
+    }
+
+    M::body(span<C*>(targets->data(), n), extras...);
+  }
+};
+
+template<class M, class C, typename... E>
+struct batch_wrapper<M, C, void(span<C*>, E...)> {
+  using target_class = typename std::remove_cv<C>::type;
+
+  static void body(C** objects, std::size_t n, E... extras) {
+    M::body(span<C*>(objects, n), extras...);
+  }
+};
+
+template<typename R, typename... P>
+template<class M>
+void multi_method_implementation<R, P...>::add_batch_spec() {
+  using base = typename std::remove_pointer<typename batch<R, P...>::first_pointer>::type;
+  using target = batch_wrapper<M, base, typename M::body_signature::type>;
+
+  static_assert(
+    std::is_same<decltype(&target::body), typename batch<R, P...>::batch_pointer_type>::value,
+    "the batch specialization's parameters do not match the multi-method's");
+
+  batch_specs[&mm_class::of<typename target::target_class>::the()] =
+    reinterpret_cast<void_function_pointer>(target::body);
+  invalidate();
+}
+
 #ifdef YOREL_MM_TRACE
 
 template<typename C1, typename C2, typename... CN>
@@ -21,13 +21,21 @@
   YOREL_MM_TRACE(const char* _yomm11_name_(CLASS*) { return #CLASS; })     \
   namespace { ::yorel::multi_methods::mm_class::initializer<CLASS, ::yorel::multi_methods::mm_class::base_list<__VA_ARGS__>> _yomm11_add_class_ ## CLASS; }
 
+#define MM_FOREIGN_TAGGED_ROOT(CLASS, ACCESSOR)                         \
+  inline ::yorel::multi_methods::detail::class_tag<CLASS> _yomm11_class_tag_(const CLASS* obj) { \
+    return { static_cast<int>(::yorel::multi_methods::detail::get_tag(obj, ACCESSOR)) }; \
+  }
+
+#define MM_FOREIGN_CLASS_TAG(CLASS, TAG)                                \
+  namespace { ::yorel::multi_methods::detail::register_tag<CLASS> _yomm11_add_tag_ ## CLASS(TAG); }
+
 #define MM_INIT()                                                       \
   ::yorel::multi_methods::detail::init_ptr<_yomm11_base_list>::init(this)
 
 #undef MM_CLASS_MULTI
 #define MM_CLASS_MULTI(CLASS, BASE, ...)                           \
   MM_CLASS(CLASS, BASE, __VA_ARGS__);                                         \
-  std::vector<mm_class::offset>* _get_yomm11_ptbl() const { return BASE::_yomm11_ptbl; }
+  mm_class::offset* _get_yomm11_ptbl() const { return BASE::_yomm11_ptbl; }
 
 #define MM_INIT_MULTI(BASE)                     \
   this->BASE::_init_yomm11_ptr(this)
@@ -44,6 +52,11 @@
   YOREL_MM_TRACE(inline const char* _yomm11_name_(::yorel::multi_methods::multi_method<ID ## _specialization, RETURN_TYPE(__VA_ARGS__)>*) { return #ID; })     \
   YOMM_CONSTEXPR ::yorel::multi_methods::multi_method<ID ## _specialization, RETURN_TYPE(__VA_ARGS__)> ID
 
+#define MULTI_METHOD_WITH_POLICY(ID, POLICY, RETURN_TYPE, ...)        \
+  template<typename Sig> struct ID ## _specialization;                  \
+  YOREL_MM_TRACE(inline const char* _yomm11_name_(::yorel::multi_methods::multi_method<ID ## _specialization, RETURN_TYPE(__VA_ARGS__), POLICY>*) { return #ID; })     \
+  YOMM_CONSTEXPR ::yorel::multi_methods::multi_method<ID ## _specialization, RETURN_TYPE(__VA_ARGS__), POLICY> ID
+
 #define BEGIN_SPECIALIZATION(ID, RESULT, ...)                       \
   template<>                                                            \
   struct ID ## _specialization<RESULT(__VA_ARGS__)> : std::remove_const<decltype(ID)>::type::specialization< ID ## _specialization<RESULT(__VA_ARGS__)> > { \
@@ -51,6 +64,24 @@
   using body_signature = ::yorel::multi_methods::detail::signature<RESULT(__VA_ARGS__)>; \
     static RESULT body(__VA_ARGS__) {
 
+#define BEGIN_BATCH_SPECIALIZATION(ID, RESULT, ...)                 \
+  template<>                                                            \
+  struct ID ## _specialization<RESULT(__VA_ARGS__)> {                   \
+  virtual void* _yomm11_install() { return &::yorel::multi_methods::register_batch_spec<decltype(ID), ID ## _specialization>::the; } \
+  using body_signature = ::yorel::multi_methods::detail::signature<RESULT(__VA_ARGS__)>; \
+    static RESULT body(__VA_ARGS__) {
+
+#define BEGIN_SEALED_SPECIALIZATION(NAME, RESULT, ...)                 \
+  struct NAME {                                                         \
+  using body_signature = ::yorel::multi_methods::detail::signature<RESULT(__VA_ARGS__)>; \
+    static RESULT body(__VA_ARGS__) {
+
 #define END_SPECIALIZATION } };
 
 #define GET_SPECIALIZATION(ID, RESULT, ...) ID ## _specialization<RESULT(__VA_ARGS__)>::body
+
+#define MM_CACHED_CALL(ID, ...)                                         \
+  ([&]() -> std::remove_const<decltype(ID)>::type::return_type {        \
+    static thread_local std::remove_const<decltype(ID)>::type::call_site _yomm11_site; \
+    return _yomm11_site(__VA_ARGS__);                                   \
+  }())
@@ -31,6 +31,10 @@
 #include <algorithm>
 #include <stdexcept>
 #include <iostream>
+#include <limits>
+#include <cstdint>
+#include <cstddef>
+#include <atomic>
 
 //#define YOREL_MM_ENABLE_TRACE
 #ifdef YOREL_MM_ENABLE_TRACE
@@ -43,6 +47,15 @@
 #include <iterator>
 #endif
 
+#if defined(__GNUC__)
+#define YOREL_MM_PREFETCH(address) __builtin_prefetch(address)
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <xmmintrin.h>
+#define YOREL_MM_PREFETCH(address) _mm_prefetch(reinterpret_cast<const char*>(address), _MM_HINT_T0)
+#else
+#define YOREL_MM_PREFETCH(address)
+#endif
+
 namespace yorel {
 namespace multi_methods {
 
@@ -54,10 +67,15 @@ template<class Class> struct virtual_;
 struct mm_class;
 template<class B, class D> struct cast_using_static_cast;
 template<class B, class D> struct cast_using_dynamic_cast;
+template<class B, class D> struct cast_using_cached_offset;
 template<class B, class D> struct cast;
+template<typename T> class span;
 struct method_base;
 struct multi_method_base;
-template<template<typename Sig> class Method, typename Sig> struct multi_method;
+struct grouped_dispatch;
+struct dense_dispatch;
+struct compare_dispatch;
+template<template<typename Sig> class Method, typename Sig, class Policy = grouped_dispatch> struct multi_method;
 class undefined;
 class ambiguous;
 
@@ -76,6 +94,10 @@ std::ostream& operator <<(std::ostream& os, const multi_method_base* pc);
 namespace detail {
 //using bitvec = boost::dynamic_bitset<>;
 
+struct compare_keys;
+
+// Bit vectors of up to 128 bits are stored inline. The word loops are
+// simple enough for the compiler to vectorize.
 class bitvec {
   using word = unsigned long;
  public:
@@ -86,28 +108,31 @@ class bitvec {
     ref(word* p, int i) : p(p), i(i) {
     }
     operator bool() const {
-      return (p[i / bpw] & (1 << (i % bpw))) != 0;
+      return (p[i / bpw] & bit(i)) != 0;
     }
     ref& operator =(bool val) {
       if (val) {
-        p[i / bpw] |= 1 << (i % bpw);
+        p[i / bpw] |= bit(i);
       } else {
-        p[i / bpw] &= ~(1 << (i % bpw));
+        p[i / bpw] &= ~bit(i);
       }
       return *this;
     }
     ref& operator |=(bool val) {
       if (val) {
-        p[i / bpw] |= 1 << (i % bpw);
+        p[i / bpw] |= bit(i);
       }
       return *this;
     }
   };
 
-  bitvec() : p(nullptr), n(0) { }
+  static const int npos = -1;
+
+  bitvec() : n(0), capacity(local_words), p(local) { }
 
-  bitvec(int n) : n(n), p(nullptr) {
-    p = new word[wsize(n)];
+  bitvec(int n) : n(0), capacity(local_words), p(local) {
+    reserve(n);
+    this->n = n;
     std::fill(wbegin(), wend(), 0);
   }
 
@@ -115,55 +140,117 @@ class bitvec {
     *p = init;
   }
 
-  bitvec(const bitvec& other) : bitvec(other.n) {
-    std::copy(other.p, other.p + wsize(other.n), p);
+  bitvec(const bitvec& other) : bitvec() {
+    *this = other;
+  }
+
+  bitvec(bitvec&& other) : bitvec() {
+    *this = std::move(other);
   }
 
-  ~bitvec() { delete [] p; }
+  ~bitvec() { release(); }
 
   bitvec& operator =(const bitvec& other) {
-    size_t ws = wsize(other.n);
-    word* np = new word[ws];
-    std::copy(other.wbegin(), other.wend(), np);
-    delete [] p;
-    p = np;
-    n = other.size();
+    if (this != &other) {
+      reserve(other.n);
+      n = other.n;
+      std::copy(other.wbegin(), other.wend(), wbegin());
+    }
+    return *this;
+  }
+
+  bitvec& operator =(bitvec&& other) {
+    if (this != &other) {
+      if (other.p == other.local) {
+        reserve(other.n);
+        std::copy(other.wbegin(), other.wend(), wbegin());
+      } else {
+        release();
+        p = other.p;
+        capacity = other.capacity;
+        other.p = other.local;
+        other.capacity = local_words;
+      }
+      n = other.n;
+      other.n = 0;
+    }
     return *this;
   }
 
   int size() const { return n; }
 
   void resize(int size) {
-    size_t new_ws = wsize(size);
-    word* new_p = new word[new_ws];
-    size_t old_ws = wsize(n);
-    auto end = std::copy(p, p + std::min(old_ws, new_ws), new_p);
-    std::fill(end, new_p + new_ws, 0);
-    if (size < n) {
-      if (size_t rem = size % bpw) {
-        end[-1] &= (1 << rem) - 1;
-      }
+    reserve(size);
+    if (size > n) {
+      std::fill(wend(), p + wsize(size), 0);
     }
-    delete [] p;
-    p = new_p;
     n = size;
+    if (size_t rem = size % bpw) {
+      wend()[-1] &= bit(rem) - 1;
+    }
   }
 
   bool none() const {
-    return std::all_of(p, p + wsize(n), [](word w) { return w == 0; });
+    return std::all_of(wbegin(), wend(), [](word w) { return w == 0; });
+  }
+
+  // bits first to last, inclusive
+  bool any(int first, int last) const {
+    for (int w = first / bpw; w <= last / bpw; w++) {
+      if (p[w] & range(w, first, last)) {
+        return true;
+      }
+    }
+
+    return false;
+  }
+
+  void set(int first, int last) {
+    for (int w = first / bpw; w <= last / bpw; w++) {
+      p[w] |= range(w, first, last);
+    }
+  }
+
+  int count() const {
+    int result = 0;
+    for (const word* w = wbegin(); w != wend(); w++) {
+      result += popcount(*w);
+    }
+    return result;
+  }
+
+  // the first bit set, or npos
+  int find_first() const {
+    return find_from(0);
+  }
+
+  // the first bit set after i, or npos
+  int find_next(int i) const {
+    return i + 1 < n ? find_from(i + 1) : npos;
   }
 
   bool operator [](int i) const {
-    return (p[i / bpw] & (1 << (i % bpw))) != 0;
+    return (p[i / bpw] & bit(i)) != 0;
   }
 
   ref operator [](int i) { return ref(p, i); }
 
+  // result = v1 & v2, without allocating if result is large enough
+  friend void and_into(bitvec& result, const bitvec& v1, const bitvec& v2) {
+    result.reserve(v1.n);
+    result.n = v1.n;
+    const int ws = wsize(v1.n);
+    const word* w1 = v1.p;
+    const word* w2 = v2.p;
+    word* res = result.p;
+    for (int i = 0; i < ws; i++) {
+      res[i] = w1[i] & w2[i];
+    }
+  }
+
   friend bitvec operator &(const bitvec& v1, const bitvec& v2) {
-    bitvec res(v1.size());
-    std::transform(
-        v1.wbegin(), v1.wend(), v2.wbegin(), res.wbegin(),
-        [](word w1, word w2) { return w1 & w2; });
+    bitvec res;
+    and_into(res, v1, v2);
     return res;
   }
 
@@ -177,10 +264,17 @@ class bitvec {
         v2.wbegin(), v2.wend());
   }
 
+  bitvec& operator &=(const bitvec& other) {
+    and_into(*this, *this, other);
+    return *this;
+  }
+
   bitvec& operator |=(const bitvec& other) {
-    std::transform(
-        other.wbegin(), other.wend(), wbegin(), wbegin(),
-        [](word w1, word w2) { return w1 | w2; });
+    const int ws = wsize(other.n);
+    const word* w = other.p;
+    for (int i = 0; i < ws; i++) {
+      p[i] |= w[i];
+    }
     return *this;
   }
 
@@ -190,7 +284,7 @@ class bitvec {
         wbegin(), wend(), res.wbegin(),
         [](word w) { return ~w; });
     if (size_t rem = n % bpw) {
-      res_last[-1] &= (1 << rem) - 1;
+      res_last[-1] &= bit(rem) - 1;
     }
     return res;
   }
@@ -204,10 +298,86 @@ class bitvec {
   const word* wend() const { return p + wsize(n); }
 
  private:
-  static size_t wsize(int n) { return (n + bpw - 1) / bpw; }
   static const int bpw = std::numeric_limits<word>::digits;
+  static const int local_words = (128 + bpw - 1) / bpw;
+
+  static int wsize(int n) { return (n + bpw - 1) / bpw; }
+
+  static word bit(int i) { return word(1) << (i % bpw); }
+
+  // the bits of word w between first and last
+  static word range(int w, int first, int last) {
+    word bits = ~word(0);
+    if (w == first / bpw) {
+      bits &= ~word(0) << (first % bpw);
+    }
+    if (w == last / bpw) {
+      bits &= ~word(0) >> (bpw - 1 - last % bpw);
+    }
+    return bits;
+  }
+
+  static int popcount(word w) {
+#ifdef __GNUC__
+    return __builtin_popcountl(w);
+#else
+    int result = 0;
+    for (; w; w &= w - 1) {
+      ++result;
+    }
+    return result;
+#endif
+  }
+
+  static int lowest_bit(word w) {
+#ifdef __GNUC__
+    return __builtin_ctzl(w);
+#else
+    int result = 0;
+    for (; !(w & 1); w >>= 1) {
+      ++result;
+    }
+    return result;
+#endif
+  }
+
+  int find_from(int i) const {
+    const int ws = wsize(n);
+    int w = i / bpw;
+    word bits = w < ws ? p[w] & (~word(0) << (i % bpw)) : 0;
+
+    while (!bits) {
+      if (++w >= ws) {
+        return npos;
+      }
+      bits = p[w];
+    }
+
+    return w * bpw + lowest_bit(bits);
+  }
+
+  // room for size bits; keeps the current words
+  void reserve(int size) {
+    const int ws = wsize(size);
+    if (ws > capacity) {
+      word* new_p = new word[ws];
+      std::copy(wbegin(), wend(), new_p);
+      release();
+      p = new_p;
+      capacity = ws;
+    }
+  }
+
+  void release() {
+    if (p != local) {
+      delete [] p;
+    }
+  }
+
   int n;
+  int capacity; // in words
   word* p;
+  word local[local_words];
 };
 
 std::ostream& operator <<(std::ostream& os, const bitvec& v);
@@ -232,9 +402,57 @@ struct mm_class {
     int arg;
   };
 
+  // Where the D sub-object sits in a complete object of a given dynamic
+  // type, for a cast from a virtual base B to D; see
+  // cast_using_cached_offset. Written once, by the first call that needs
+  // it. The first entry of each array only holds the array's size.
+  struct adjustment {
+    std::atomic<const std::type_info*> type;
+    std::atomic<std::ptrdiff_t> offset;
+  };
+
   union offset {
     int index;
-    void (**ptr)();
+    void (**ptr)(); // first virtual argument of a multi-method
+    void (*pf)(); // sole virtual argument: the target itself
+    adjustment* adjustments;
+  };
+
+  // Contiguous array of offsets, one per slot. Objects point directly at
+  // the storage. It moves when the table outgrows its capacity, but only
+  // until an object has been given its address, see pin(); after that,
+  // resize() throws rather than move it.
+  class table {
+   public:
+    table();
+    ~table();
+    table(const table&) = delete;
+    table& operator =(const table&) = delete;
+
+    offset* data() const { return p; }
+    offset* pin() {
+      if (!pinned.load(std::memory_order_relaxed)) {
+        pinned.store(true, std::memory_order_relaxed);
+      }
+      return p;
+    }
+    int size() const { return n; }
+    void resize(int size);
+    offset& operator [](int i) { return p[i]; }
+    const offset& operator [](int i) const { return p[i]; }
+    // the entry just before the data: the class's index in its sealed
+    // hierarchy, or -1, see sealed_multi_method
+    offset& header() { return p[-1]; }
+    // the entry before the header: the class's adjustments, indexed by
+    // the numbers that add_adjustment() hands out
+    adjustment* adjustments() const { return p[-2].adjustments; }
+    void reserve_adjustments(int size);
+
+   private:
+    offset* p;
+    int n;
+    int capacity;
+    std::atomic<bool> pinned;
   };
 
   mm_class(YOREL_MM_TRACE(const char* name));
@@ -243,26 +461,52 @@ struct mm_class {
   void initialize(const std::vector<mm_class*>& bases);
   void add_multi_method(multi_method_base* pm, int arg);
   void remove_multi_method(multi_method_base* pm);
-  void for_each_spec(std::function<void(mm_class*)> pf);
-  void for_each_conforming(std::function<void(mm_class*)> pf);
-  void for_each_conforming(std::unordered_set<const mm_class*>& visited, std::function<void(mm_class*)> pf);
+  // Call pf once for each class derived from this one (and this one, for
+  // for_each_conforming), in depth-first order, even if there are diamonds
+  // in the hierarchy. pf must not start another traversal.
+  template<class F> void for_each_spec(F pf);
+  template<class F> void for_each_conforming(F pf);
   bool conforms_to(const mm_class& other) const;
   bool specializes(const mm_class& other) const;
   bool is_root() const;
+  mm_class* find_root();
 
   YOREL_MM_TRACE(const char* name);
   std::vector<mm_class*> bases;
   std::vector<mm_class*> specs;
-  detail::bitvec mask;
   int index;
+  // Subtype test: the classes that conform to this one are numbered from
+  // 'low' to 'high', plus those numbered in 'extra_specs' (multiple
+  // inheritance). See hierarchy_initializer::number_classes().
+  int low{-1};
+  int high{-1};
+  std::vector<int> extra_bases; // sorted
+  std::vector<int> extra_specs;
   mm_class* root{nullptr};
-  std::vector<mm_class::offset> mmt;
+  table mmt;
   std::vector<mmref> rooted_here; // multi_methods rooted here for one or more args.
   bool abstract;
+  unsigned mark{0};
+
+  // a value that no class is marked with yet
+  static unsigned last_mark;
+  static unsigned next_mark();
 
   static std::unordered_set<mm_class*>* to_initialize;
   static void add_to_initialize(mm_class* pc);
   static void remove_from_initialize(mm_class* pc);
+  // classes added or removed since the last initialize(): the
+  // multi-methods rooted in them or their ancestors must be resolved again
+  static std::unordered_set<mm_class*>* to_invalidate;
+  static void add_to_invalidate(mm_class* pc);
+  static void remove_from_invalidate(mm_class* pc);
+  static void invalidate_methods();
+
+  // casts from a virtual base, numbered from 1 as they are instantiated;
+  // initialize() makes room for them in the tables
+  static int adjustment_count;
+  static int add_adjustment();
+  static void set_adjustment(adjustment* adjustments, int i, const std::type_info* type, std::ptrdiff_t offset);
 
   template<class Class>
   struct of {
@@ -297,6 +541,32 @@ inline bool mm_class::is_root() const {
   return this == root;
 }
 
+template<class F>
+void mm_class::for_each_conforming(F pf) {
+  unsigned visited = next_mark();
+  std::vector<mm_class*> pending { this };
+
+  while (!pending.empty()) {
+    mm_class* pc = pending.back();
+    pending.pop_back();
+
+    if (pc->mark != visited) {
+      pc->mark = visited;
+      pf(pc);
+      pending.insert(pending.end(), pc->specs.rbegin(), pc->specs.rend());
+    }
+  }
+}
+
+template<class F>
+void mm_class::for_each_spec(F pf) {
+  for_each_conforming([=](mm_class* pc) {
+      if (pc != this) {
+        pf(pc);
+      }
+    });
+}
+
 struct method_base {
   virtual ~method_base();
 
@@ -309,16 +579,16 @@ struct method_base {
 
 struct selector {
   selector() : _yomm11_ptbl(0) { }
-  std::vector<mm_class::offset>* _yomm11_ptbl;
+  mm_class::offset* _yomm11_ptbl;
   virtual ~selector() { }
   template<class THIS>
   void _init_yomm11_ptr(THIS*);
-  std::vector<mm_class::offset>* _get_yomm11_ptbl() const { return _yomm11_ptbl; }
+  mm_class::offset* _get_yomm11_ptbl() const { return _yomm11_ptbl; }
 };
 
 template<class THIS>
 inline void selector::_init_yomm11_ptr(THIS*) {
-  _yomm11_ptbl = &mm_class::of<THIS>::the().mmt;
+  _yomm11_ptbl = mm_class::of<THIS>::the().mmt.pin();
 }
 
 template<class Class>
@@ -326,6 +596,24 @@ struct virtual_ {
   using type = Class;
 };
 
+// A contiguous sequence of objects, passed to batch specializations.
+template<typename T>
+class span {
+public:
+  span(T* first, std::size_t n) : first(first), n(n) { }
+
+  T* begin() const { return first; }
+  T* end() const { return first + n; }
+  T* data() const { return first; }
+  std::size_t size() const { return n; }
+  bool empty() const { return n == 0; }
+  T& operator [](std::size_t i) const { return first[i]; }
+
+private:
+  T* first;
+  std::size_t n;
+};
+
 template<class B, class D>
 struct cast_using_static_cast {
   static D& value(B& obj) { return static_cast<D&>(obj); }
@@ -339,11 +627,14 @@ struct cast_using_dynamic_cast {
 };
 
 struct multi_method_base {
-  explicit multi_method_base(const std::vector<mm_class*>& v YOREL_MM_COMMA_TRACE(const char* name));
-  virtual ~multi_method_base();
-
+  using resolver = void (*)(multi_method_base&);
   using void_function_pointer = void (*)();
 
+  multi_method_base(
+    const std::vector<mm_class*>& v, int* slots_strides YOREL_MM_COMMA_TRACE(const char* name),
+    resolver resolve_with, void_function_pointer* direct);
+  virtual ~multi_method_base();
+
   void resolve();
   virtual void_function_pointer* allocate_dispatch_table(int size) = 0;
   virtual void emit(method_base*, int i) = 0;
@@ -354,16 +645,123 @@ struct multi_method_base {
   std::vector<mm_class*> vargs;
   std::vector<int> slots;
   std::vector<method_base*> methods;
-  std::vector<int> steps;
+  int* slots_strides; // points to the multi_method's detail::dispatch_data
+  resolver resolve_with; // builds the dispatch table, from the dispatch policy
+  void_function_pointer* direct; // points to the multi_method's dispatch_data
+  detail::compare_keys* keys = nullptr; // same, for compare_dispatch only
+  // the targets cached by calls on final classes, cleared by resolve()
+  std::vector<std::atomic<void_function_pointer>*> final_targets;
+  void add_final_target(std::atomic<void_function_pointer>* target);
   YOREL_MM_TRACE(const char* name);
 
   static std::unordered_set<multi_method_base*>* to_initialize;
   static void add_to_initialize(multi_method_base* pm);
   static void remove_from_initialize(multi_method_base* pm);
+
+  // incremented by initialize() whenever it changes dispatch data
+  static std::size_t generation;
 };
 
 #include <yorel/multi_methods/detail.hpp>
 
+// Dispatch policies: how initialize() builds the dispatch table of a
+// multi-method, and how a call finds its cell. Policies share the
+// specializations, the dispatch_data and the emit() interface of
+// multi_method_implementation. 'mmt_layout' tells whether the cell for
+// a call is found from the mmt entries of the arguments' classes and the
+// strides, as in grouped_dispatch; bind(), for_each() and
+// for_each_pair() read the table that way, and require it.
+
+// Classes that select the same specializations share a row (or column)
+// of the table. This is the default.
+struct grouped_dispatch {
+  template<int Arity>
+  using data = detail::dispatch_data<Arity>;
+  static const bool mmt_layout = true;
+
+  static void resolve(multi_method_base& mm);
+
+  template<typename... P>
+  using lookup = detail::linear_lookup<P...>;
+};
+
+// One row (or column) per class. The table is larger, but it is built
+// without comparing the specializations applicable to each class, which
+// is cheaper for methods with few classes and many specializations.
+struct dense_dispatch {
+  template<int Arity>
+  using data = detail::dispatch_data<Arity>;
+  static const bool mmt_layout = true;
+
+  static void resolve(multi_method_base& mm);
+
+  template<typename... P>
+  using lookup = detail::linear_lookup<P...>;
+};
+
+// Same table as grouped_dispatch. When a virtual parameter has no more
+// than compare_keys::size conforming classes, a call compares the mmt of
+// the argument's class with theirs, instead of loading the entry from
+// the mmt and multiplying it by the stride. Whether this pays depends on
+// the processor: measure (see benchmarks.cpp) before using it.
+struct compare_dispatch {
+  template<int Arity>
+  using data = detail::compare_data<Arity>;
+  static const bool mmt_layout = true;
+
+  static void resolve(multi_method_base& mm);
+
+  template<typename... P>
+  struct lookup {
+    template<int Arity, typename... A>
+    static multi_method_base::void_function_pointer* value(const detail::compare_data<Arity>& data, A... args) {
+      return detail::compare_linear<0, P...>::value(data.slots_strides, data.keys, args...);
+    }
+  };
+};
+
+// The distance from the complete object to its D sub-object depends only
+// on the dynamic type, whichever B sub-object the argument refers to. It
+// is kept in the table of the object's class: dynamic_cast is needed only
+// the first time an object of a given type is seen.
+template<class B, class D>
+struct cast_using_cached_offset {
+  static const int id;
+
+  static std::ptrdiff_t offset(const B& obj, const void* top) {
+    const std::type_info* type = &typeid(obj);
+    mm_class::adjustment* adjustments = detail::mm_table_of<B>::type::value(&obj)[-2].adjustments;
+
+    if (id < adjustments[0].offset.load(std::memory_order_relaxed)) {
+      const mm_class::adjustment& known = adjustments[id];
+
+      if (known.type.load(std::memory_order_acquire) == type) {
+        return known.offset.load(std::memory_order_relaxed);
+      }
+    }
+
+    std::ptrdiff_t offset = reinterpret_cast<const char*>(&dynamic_cast<const D&>(obj))
+      - static_cast<const char*>(top);
+    mm_class::set_adjustment(adjustments, id, type, offset);
+
+    return offset;
+  }
+
+  static D& value(B& obj) {
+    char* top = static_cast<char*>(dynamic_cast<void*>(&obj));
+    return *reinterpret_cast<D*>(top + offset(obj, top));
+  }
+
+  static const D& value(const B& obj) {
+    const char* top = static_cast<const char*>(dynamic_cast<const void*>(&obj));
+    return *reinterpret_cast<const D*>(top + offset(obj, top));
+  }
+};
+
+// 0 until the dynamic initialization has run, which is never an index
+template<class B, class D>
+const int cast_using_cached_offset<B, D>::id = mm_class::add_adjustment();
+
 template<class B, class D>
 struct cast : detail::cast_best<B, D, detail::is_virtual_base_of<B, D>::value> {
 };
@@ -387,21 +785,38 @@ mm_class::initializer<Class, mm_class::base_list<Bases...>>::initializer() {
     if (!detail::get_mm_table<false>::class_of) {
       detail::get_mm_table<false>::class_of = new detail::get_mm_table<false>::class_of_type;
     }
-    (*detail::get_mm_table<false>::class_of)[std::type_index(typeid(Class))] = &pc.mmt;
+    (*detail::get_mm_table<false>::class_of)[std::type_index(typeid(Class))] = { &typeid(Class), &pc.mmt };
   }
 }
 
 template<class Class, class... Bases>
 mm_class::initializer<Class, mm_class::base_list<Bases...>> mm_class::initializer<Class, mm_class::base_list<Bases...>>::the;
 
-template<template<typename Sig> class Method, typename R, typename... P>
-struct multi_method<Method, R(P...)> {
+template<template<typename Sig> class Method, typename R, typename... P, class Policy>
+struct multi_method<Method, R(P...), Policy> {
 
 #ifdef __cpp_constexpr
   constexpr
 #endif
   multi_method() {}
   R operator ()(typename detail::remove_virtual<P>::type... args) const;
+
+  // Calls where the static type of each virtual argument is a final
+  // class: the specialization depends only on these types. The first
+  // such call looks it up, and the following ones call it through
+  // final_call::target, until initialize() builds the dispatch table again.
+  template<
+    typename... A,
+    typename = typename std::enable_if<detail::final_args<P...>::template apply<A...>::value>::type>
+  R operator ()(A&&... args) const {
+    using call = final_call<typename std::decay<A>::type...>;
+    if (auto target = call::target.load(std::memory_order_relaxed)) {
+      return reinterpret_cast<method_pointer_type>(target)(std::forward<A>(args)...);
+    }
+
+    return call::bind(std::forward<A>(args)...);
+  }
+
   static R method(typename detail::remove_virtual<P>::type... args);
 
   using return_type = R;
@@ -420,6 +835,7 @@ struct multi_method<Method, R(P...)> {
   using implementation = detail::multi_method_implementation<R, P...>;
   static implementation& the();
   static implementation* impl;
+  static typename Policy::template data<detail::arity<virtuals>::value> dispatch;
 
   template<class Spec>
   static bool specialize() {
@@ -427,12 +843,135 @@ struct multi_method<Method, R(P...)> {
     return true;
   }
 
+  template<class Spec>
+  static bool specialize_batch() {
+    the().template add_batch_spec<Spec>();
+    return true;
+  }
+
+  // The specialization for the argument types A..., see the call
+  // operator for final classes.
+  template<class... A>
+  struct final_call {
+    static std::atomic<multi_method_base::void_function_pointer> target;
+    static R bind(typename detail::remove_virtual<P>::type... args);
+  };
+
   template<class Spec>
   struct specialization {
     static method_pointer_type next;
     // this doesn't work on clang, must do it in BEGIN_SPECIALIZATION
     // virtual void* _yomm11_install() { return &register_spec<Spec>::the; }
   };
+
+  // Remembers the classes of the virtual arguments of the last call made
+  // through it, and the specialization they selected. A call with the
+  // same classes skips the dispatch tables. Not thread-safe: meant to be
+  // a static thread_local object at the call site, see MM_CACHED_CALL.
+  struct call_site {
+    R operator ()(typename detail::remove_virtual<P>::type... args);
+
+    const void* keys[detail::arity<virtuals>::value];
+    method_pointer_type target;
+    std::size_t generation;
+  };
+
+  // The specialization selected for a given set of arguments, see
+  // resolve(). Calling it skips the dispatch tables, until initialize()
+  // changes them; after that, calls go through full dispatch again.
+  struct resolved {
+    R operator ()(typename detail::remove_virtual<P>::type... args) const;
+    bool valid() const { return generation == multi_method_base::generation; }
+
+    method_pointer_type target;
+    std::size_t generation;
+  };
+
+  static resolved resolve(typename detail::remove_virtual<P>::type... args);
+
+  // Start loading the dispatch table cell for a call with these
+  // arguments, without making it. This reads the objects, thus it works
+  // best if they have been prefetched earlier.
+  static void prefetch(typename detail::remove_virtual<P>::type... args);
+
+  using bound = detail::bound<R, P...>;
+
+  static bound bind(typename bound::first_type first) {
+    static_assert(Policy::mmt_layout, "bind() requires a policy with the mmt layout");
+    return bound(dispatch.slots_strides, first);
+  }
+
+  // Call the multi-method for each pair of objects in [first1, last1) x
+  // [first2, last2), ranges of pointers. Pairs are grouped by the
+  // specialization they select, thus not called in range order.
+  template<class I1, class I2, typename... X>
+  static void for_each_pair(I1 first1, I1 last1, I2 first2, I2 last2, X&&... extras) {
+    static_assert(Policy::mmt_layout, "for_each_pair() requires a policy with the mmt layout");
+    detail::pairwise<R, P...>::for_each_pair(dispatch.slots_strides, first1, last1, first2, last2, extras...);
+  }
+
+  // Same, for each unordered pair of distinct elements of [first, last).
+  // Each pair is passed once, in an unspecified order.
+  template<class I, typename... X>
+  static void for_each_unordered_pair(I first, I last, X&&... extras) {
+    static_assert(Policy::mmt_layout, "for_each_unordered_pair() requires a policy with the mmt layout");
+    detail::pairwise<R, P...>::for_each_unordered_pair(dispatch.slots_strides, first, last, extras...);
+  }
+
+  // Call the multi-method for each object in [first, last), a range of
+  // pointers. The objects are grouped by specialization, thus not
+  // processed in range order, but in range order within a group. Groups
+  // for which a batch specialization exists are passed to it as a span.
+  template<class I, typename... X>
+  static void for_each(I first, I last, X&&... extras) {
+    static_assert(Policy::mmt_layout, "for_each() requires a policy with the mmt layout");
+    detail::batch<R, P...>::for_each(impl, dispatch.slots_strides, first, last, extras...);
+  }
+
+  // Call the multi-method for each object in [first, last), a random
+  // access range of pointers, in as many threads as the hardware
+  // supports. Exceptions are propagated to the caller.
+  template<class I, typename... X>
+  static void parallel_for_each(I first, I last, X&&... extras) {
+    std::size_t n = last - first;
+    detail::parallel_chunks(
+      n, detail::parallel_workers(n),
+      [&](unsigned, std::size_t begin, std::size_t end) {
+        for (std::size_t i = begin; i != end; ++i) {
+          method(*first[i], extras...);
+        }
+      });
+  }
+
+  // Same, combining the results with 'op', in no particular order. 'op'
+  // must be associative and commutative, and 'identity' must be its
+  // identity element (e.g. 0 for addition).
+  template<typename T, class I, class Op, typename... X>
+  static T parallel_reduce(I first, I last, T identity, Op op, X&&... extras) {
+    // a cache line between the partials, which different threads update
+    struct partial { T value; char padding[64]; };
+    std::size_t n = last - first;
+    unsigned workers = detail::parallel_workers(n);
+    std::vector<partial> partials(workers, partial { identity });
+
+    detail::parallel_chunks(
+      n, workers,
+      [&](unsigned worker, std::size_t begin, std::size_t end) {
+        T result = identity;
+        for (std::size_t i = begin; i != end; ++i) {
+          result = op(result, method(*first[i], extras...));
+        }
+        partials[worker].value = op(partials[worker].value, result);
+      });
+
+    T result = identity;
+
+    for (auto& p : partials) {
+      result = op(result, p.value);
+    }
+
+    return result;
+  }
 };
 
 template<class Method, class Spec>
@@ -448,37 +987,123 @@ struct register_spec {
 template<class Method, class Spec>
 register_spec<Method, Spec> register_spec<Method, Spec>::the;
 
-template<template<typename Sig> class Method, typename R, typename... P>
+template<class Method, class Spec>
+struct register_batch_spec {
+  register_batch_spec() {
+    Method::template specialize_batch<Spec>();
+  }
+  static register_batch_spec the;
+};
+
+template<class Method, class Spec>
+register_batch_spec<Method, Spec> register_batch_spec<Method, Spec>::the;
+
+template<template<typename Sig> class Method, typename R, typename... P, class Policy>
 template<class Spec>
-typename multi_method<Method, R(P...)>::method_pointer_type
-multi_method<Method, R(P...)>::specialization<Spec>::next;
+typename multi_method<Method, R(P...), Policy>::method_pointer_type
+multi_method<Method, R(P...), Policy>::specialization<Spec>::next;
+
+template<template<typename Sig> class Method, typename R, typename... P, class Policy>
+typename multi_method<Method, R(P...), Policy>::implementation* multi_method<Method, R(P...), Policy>::impl;
 
-template<template<typename Sig> class Method, typename R, typename... P>
-typename multi_method<Method, R(P...)>::implementation* multi_method<Method, R(P...)>::impl;
+template<template<typename Sig> class Method, typename R, typename... P, class Policy>
+template<class... A>
+std::atomic<multi_method_base::void_function_pointer> multi_method<Method, R(P...), Policy>::final_call<A...>::target { nullptr };
 
-template<template<typename Sig> class Method, typename R, typename... P>
+template<template<typename Sig> class Method, typename R, typename... P, class Policy>
+typename Policy::template data<detail::arity<typename multi_method<Method, R(P...), Policy>::virtuals>::value> multi_method<Method, R(P...), Policy>::dispatch;
+
+template<template<typename Sig> class Method, typename R, typename... P, class Policy>
 template<typename Tag>
-typename multi_method<Method, R(P...)>::method_pointer_type multi_method<Method, R(P...)>::next_ptr<Tag>::next;
+typename multi_method<Method, R(P...), Policy>::method_pointer_type multi_method<Method, R(P...), Policy>::next_ptr<Tag>::next;
 
-template<template<typename Sig> class Method, typename R, typename... P>
-typename multi_method<Method, R(P...)>::implementation& multi_method<Method, R(P...)>::the() {
+template<template<typename Sig> class Method, typename R, typename... P, class Policy>
+typename multi_method<Method, R(P...), Policy>::implementation& multi_method<Method, R(P...), Policy>::the() {
   if (!impl) {
-    impl = new implementation(YOREL_MM_TRACE(_yomm11_name_((multi_method<Method, R(P...)>*) nullptr)));
+    impl = new implementation(dispatch.slots_strides YOREL_MM_COMMA_TRACE(_yomm11_name_((multi_method<Method, R(P...), Policy>*) nullptr)), &Policy::resolve, &dispatch.direct);
+    impl->keys = detail::keys_of(dispatch);
   }
 
   return *impl;
 }
 
-template<template<typename Sig> class Method, typename R, typename... P>
-inline R multi_method<Method, R(P...)>::operator ()(typename detail::remove_virtual<P>::type... args) const {
+template<template<typename Sig> class Method, typename R, typename... P, class Policy>
+inline R multi_method<Method, R(P...), Policy>::operator ()(typename detail::remove_virtual<P>::type... args) const {
   YOREL_MM_TRACE((std::cout << "() mm table = " << impl->dispatch_table << std::flush));
-  return reinterpret_cast<method_pointer_type>(*detail::linear<0, P...>::value(impl->slots.begin(), impl->steps.begin(), &args...))(args...);
+  if (dispatch.direct) {
+#ifndef NDEBUG
+    // look the objects up anyway, so that the other paths' checks apply
+    Policy::template lookup<P...>::value(dispatch, &args...);
+#endif
+    return reinterpret_cast<method_pointer_type>(dispatch.direct)(args...);
+  }
+
+  return reinterpret_cast<method_pointer_type>(*Policy::template lookup<P...>::value(dispatch, &args...))(args...);
 }
 
-template<template<typename Sig> class Method, typename R, typename... P>
-inline R multi_method<Method, R(P...)>::method(typename detail::remove_virtual<P>::type... args) {
+template<template<typename Sig> class Method, typename R, typename... P, class Policy>
+inline R multi_method<Method, R(P...), Policy>::method(typename detail::remove_virtual<P>::type... args) {
   YOREL_MM_TRACE((std::cout << "() mm table = " << impl->dispatch_table << std::flush));
-  return reinterpret_cast<method_pointer_type>(*detail::linear<0, P...>::value(impl->slots.begin(), impl->steps.begin(), &args...))(args...);
+  if (dispatch.direct) {
+#ifndef NDEBUG
+    // look the objects up anyway, so that the other paths' checks apply
+    Policy::template lookup<P...>::value(dispatch, &args...);
+#endif
+    return reinterpret_cast<method_pointer_type>(dispatch.direct)(args...);
+  }
+
+  return reinterpret_cast<method_pointer_type>(*Policy::template lookup<P...>::value(dispatch, &args...))(args...);
+}
+
+template<template<typename Sig> class Method, typename R, typename... P, class Policy>
+template<class... A>
+R multi_method<Method, R(P...), Policy>::final_call<A...>::bind(typename detail::remove_virtual<P>::type... args) {
+  static bool registered = (the().add_final_target(&target), true);
+  (void) registered;
+  auto pf = reinterpret_cast<method_pointer_type>(*Policy::template lookup<P...>::value(dispatch, &args...));
+  // calls racing to get here all store the same target
+  target.store(reinterpret_cast<multi_method_base::void_function_pointer>(pf), std::memory_order_relaxed);
+  return pf(args...);
+}
+
+template<template<typename Sig> class Method, typename R, typename... P, class Policy>
+inline R multi_method<Method, R(P...), Policy>::call_site::operator ()(typename detail::remove_virtual<P>::type... args) {
+  const int arity = detail::arity<virtuals>::value;
+  const void* args_keys[arity];
+  detail::virtual_keys<P...>::get(args_keys, &args...);
+
+  if (generation != multi_method_base::generation ||
+      !std::equal(args_keys, args_keys + arity, keys)) {
+    target = reinterpret_cast<method_pointer_type>(*Policy::template lookup<P...>::value(dispatch, &args...));
+    std::copy(args_keys, args_keys + arity, keys);
+    generation = multi_method_base::generation;
+  }
+
+  return target(args...);
+}
+
+template<template<typename Sig> class Method, typename R, typename... P, class Policy>
+inline typename multi_method<Method, R(P...), Policy>::resolved
+multi_method<Method, R(P...), Policy>::resolve(typename detail::remove_virtual<P>::type... args) {
+  return resolved {
+    reinterpret_cast<method_pointer_type>(*Policy::template lookup<P...>::value(dispatch, &args...)),
+    multi_method_base::generation
+  };
+}
+
+template<template<typename Sig> class Method, typename R, typename... P, class Policy>
+inline void multi_method<Method, R(P...), Policy>::prefetch(typename detail::remove_virtual<P>::type... args) {
+  auto cell = Policy::template lookup<P...>::value(dispatch, &args...);
+  YOREL_MM_PREFETCH(cell);
+}
+
+template<template<typename Sig> class Method, typename R, typename... P, class Policy>
+inline R multi_method<Method, R(P...), Policy>::resolved::operator ()(typename detail::remove_virtual<P>::type... args) const {
+  if (valid()) {
+    return target(args...);
+  }
+
+  return method(args...);
 }
 }
 }
@@ -17,27 +17,27 @@ struct hierarchy_initializer {
   hierarchy_initializer(mm_class& root);
 
   void collect_classes();
-  void make_masks();
+  void number_classes();
   void assign_slots();
   void execute();
 
   static void initialize(mm_class& root);
 
-  void topological_sort_visit(std::unordered_set<const mm_class*>& once, mm_class* pc);
+  void topological_sort_visit(unsigned sorted, mm_class* pc);
 
   mm_class& root;
   std::vector<mm_class*> nodes;
+  std::vector<std::pair<mm_class*, size_t>> pending;
 };
 
 struct grouping_resolver {
-  grouping_resolver(multi_method_base& mm);
+  // if 'merge' is false, each class gets its own group, see dense_dispatch
+  grouping_resolver(multi_method_base& mm, bool merge = true);
 
   void resolve();
   void resolve(int dim, const bitvec& candidates);
-  void find_applicable(int dim, const mm_class* pc, std::vector<method_base*>& best);
   method_base* find_best(const bitvec& candidates);
   method_base* find_best(const std::vector<method_base*>& methods);
-  void make_mask(const std::vector<method_base*>& best, bitvec& mask);
   void make_groups();
   void make_table();
   void assign_next();
@@ -50,9 +50,12 @@ struct grouping_resolver {
 
   multi_method_base& mm;
   const int dims;
+  const bool merge;
   std::vector<std::vector<group>> groups;
   multi_method_base::void_function_pointer* dispatch_table;
   int emit_at;
+  method_base* single; // the specialization in all the cells, if any
+  std::vector<bitvec> narrowed; // candidates for each dimension, see resolve()
 };
 }
 }
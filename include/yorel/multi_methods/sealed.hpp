@@ -0,0 +1,324 @@
+// -*- compile-command: "cd ../../.. && make && make test" -*-
+
+#ifndef MULTI_METHODS_SEALED_INCLUDED
+#define MULTI_METHODS_SEALED_INCLUDED
+
+// multi_method/sealed.hpp
+// Copyright (c) 2013 Jean-Louis Leroy
+// Distributed under the Boost Software License, Version 1.0. (See
+// accompanying file LICENSE_1_0.txt or copy at
+// http://www.boost.org/LICENSE_1_0.txt)
+
+// Multi-methods on closed hierarchies: all the classes and all the
+// specializations are listed, and the dispatch table is computed by the
+// compiler. Only intrusive classes are supported.
+
+#include <yorel/multi_methods/no_macros.hpp>
+
+namespace yorel {
+namespace multi_methods {
+
+template<class... Classes>
+struct sealed;
+
+template<class Sealed, typename Sig, class... Specs>
+struct sealed_multi_method;
+
+namespace detail {
+
+template<int... I>
+struct int_sequence {
+};
+
+template<int N, int... I>
+struct make_int_sequence : make_int_sequence<N - 1, N - 1, I...> {
+};
+
+template<int... I>
+struct make_int_sequence<0, I...> {
+  using type = int_sequence<I...>;
+};
+
+constexpr int power(int base, int exponent) {
+  return exponent == 0 ? 1 : base * power(base, exponent - 1);
+}
+
+template<int I, class... T>
+struct nth;
+
+template<class T, class... Rest>
+struct nth<0, T, Rest...> {
+  using type = T;
+};
+
+template<int I, class T, class... Rest>
+struct nth<I, T, Rest...> : nth<I - 1, Rest...> {
+};
+
+template<class... T>
+struct type_list {
+};
+
+// A specialization, as seen by a sealed multi-method with signature Sig:
+// the classes of its virtual parameters, and the function that goes in
+// the dispatch table.
+template<class Spec, typename Sig>
+struct sealed_spec;
+
+template<class Spec, typename R, typename... P>
+struct sealed_spec<Spec, R(P...)> {
+  using virtuals = typename extract_method_virtuals<R(P...), typename Spec::body_signature::type>::type;
+  using target = typename wrapper<
+    Spec, typename Spec::body_signature::type, R(typename remove_virtual<P>::type...)
+    >::type;
+};
+
+template<class Spec, class Classes>
+struct sealed_applicable;
+
+template<class... S, class... C>
+struct sealed_applicable<virtuals<S...>, virtuals<C...>> {
+  static const bool value = all(std::is_base_of<S, C>::value...);
+};
+
+template<class A, class B>
+struct sealed_dominates;
+
+template<class... A, class... B>
+struct sealed_dominates<virtuals<A...>, virtuals<B...>> {
+  static const bool value = all(std::is_base_of<B, A>::value...);
+};
+
+// The specializations among Specs... that apply to objects of Classes.
+template<class Classes, class Applicable, class... Specs>
+struct sealed_filter;
+
+template<class Classes, class... A>
+struct sealed_filter<Classes, type_list<A...>> {
+  using type = type_list<A...>;
+};
+
+template<class Classes, class... A, class Spec, class... Specs>
+struct sealed_filter<Classes, type_list<A...>, Spec, Specs...> : sealed_filter<
+  Classes,
+  typename std::conditional<
+    sealed_applicable<typename Spec::virtuals, Classes>::value,
+    type_list<A..., Spec>,
+    type_list<A...>
+    >::type,
+  Specs...> {
+};
+
+struct sealed_undefined;
+struct sealed_ambiguous;
+
+// The first candidate that is at least as specific as all the applicable
+// specializations; otherwise, no specialization applies, or several are
+// equally good.
+template<class Candidates, class Applicable>
+struct sealed_select;
+
+template<class... A>
+struct sealed_select<type_list<>, type_list<A...>> {
+  using type = typename std::conditional<sizeof...(A) == 0, sealed_undefined, sealed_ambiguous>::type;
+};
+
+template<class Candidate, class... Candidates, class... A>
+struct sealed_select<type_list<Candidate, Candidates...>, type_list<A...>> {
+  using type = typename std::conditional<
+    all(sealed_dominates<typename Candidate::virtuals, typename A::virtuals>::value...),
+    Candidate,
+    typename sealed_select<type_list<Candidates...>, type_list<A...>>::type
+    >::type;
+};
+
+template<typename Signature, class Choice>
+struct sealed_target {
+  static constexpr Signature* value = Choice::target::body;
+};
+
+template<typename Signature>
+struct sealed_target<Signature, sealed_undefined> {
+  static constexpr Signature* value = throw_undefined<Signature>::body;
+};
+
+template<typename Signature>
+struct sealed_target<Signature, sealed_ambiguous> {
+  static constexpr Signature* value = throw_ambiguous<Signature>::body;
+};
+
+template<class Method, class Cells>
+struct sealed_table;
+
+template<class Method, int... I>
+struct sealed_table<Method, int_sequence<I...>> {
+  static constexpr typename Method::method_pointer_type value[sizeof...(I)] = {
+    Method::template cell<I>::value...
+  };
+};
+
+template<class Method, int... I>
+constexpr typename Method::method_pointer_type sealed_table<Method, int_sequence<I...>>::value[sizeof...(I)];
+
+template<class Sealed, class C>
+int sealed_class_index(const C* obj) {
+  int index = obj->_get_yomm11_ptbl()[-1].index;
+
+  if (static_cast<unsigned>(index) >= static_cast<unsigned>(Sealed::size)) {
+    // the call may be made during static initialization, before
+    // Sealed::registered stores the indexes
+    Sealed::set_indexes();
+    index = obj->_get_yomm11_ptbl()[-1].index;
+
+    if (static_cast<unsigned>(index) >= static_cast<unsigned>(Sealed::size)) {
+      throw undefined();
+    }
+  }
+
+  return index;
+}
+
+// Position of the cell for a call in a sealed dispatch table.
+template<class Sealed, int Dim, typename... P>
+struct sealed_index;
+
+template<class Sealed, int Dim>
+struct sealed_index<Sealed, Dim> {
+  static int value() {
+    return 0;
+  }
+};
+
+template<class Sealed, int Dim, typename P1, typename... P>
+struct sealed_index<Sealed, Dim, P1, P...> {
+  template<typename A1, typename... A>
+  static int value(A1, A... args) {
+    return sealed_index<Sealed, Dim, P...>::value(args...);
+  }
+};
+
+template<class Sealed, int Dim, class C, typename... P>
+struct sealed_index<Sealed, Dim, virtual_<C>&, P...> {
+  template<typename A1, typename... A>
+  static int value(A1 arg, A... args) {
+    return sealed_class_index<Sealed, C>(arg) * power(Sealed::size, Dim)
+      + sealed_index<Sealed, Dim + 1, P...>::value(args...);
+  }
+};
+
+template<class Sealed, int Dim, class C, typename... P>
+struct sealed_index<Sealed, Dim, const virtual_<C>&, P...> {
+  template<typename A1, typename... A>
+  static int value(A1 arg, A... args) {
+    return sealed_class_index<Sealed, C>(arg) * power(Sealed::size, Dim)
+      + sealed_index<Sealed, Dim + 1, P...>::value(args...);
+  }
+};
+
+}
+
+// The classes of a closed world. Each class gets its position in the
+// list, stored in the header of its mmt when the program starts, or by
+// the first call that needs it if that happens earlier. A class can
+// appear in a single list.
+template<class... Classes>
+struct sealed {
+  static const int size = sizeof...(Classes);
+
+  static void set_indexes() {
+    set_indexes(typename detail::make_int_sequence<size>::type());
+  }
+
+  template<int... I>
+  static void set_indexes(detail::int_sequence<I...>) {
+    using expand = int[];
+    (void) expand { 0, (set_index<Classes>(I), 0)... };
+  }
+
+  template<class Class>
+  static void set_index(int index) {
+    static_assert(
+      std::is_base_of<selector, Class>::value,
+      "sealed hierarchies support only intrusive classes");
+    int& header = mm_class::of<Class>::the().mmt.header().index;
+
+    if (header != -1 && header != index) {
+      throw std::logic_error("class is listed in two sealed hierarchies");
+    }
+
+    header = index;
+  }
+
+  struct registration {
+    registration() {
+      set_indexes();
+    }
+  };
+
+  static registration registered;
+};
+
+template<class... Classes>
+const int sealed<Classes...>::size;
+
+template<class... Classes>
+typename sealed<Classes...>::registration sealed<Classes...>::registered;
+
+// A multi-method that can only be called with objects of the classes
+// listed in Sealed, and only use the specializations listed in Specs.
+// Its dispatch table contains one cell for each combination of classes,
+// computed at compile time, and needs no initialization.
+template<class... Classes, typename R, typename... P, class... Specs>
+struct sealed_multi_method<sealed<Classes...>, R(P...), Specs...> {
+  using return_type = R;
+  using signature = R(typename detail::remove_virtual<P>::type...);
+  using method_pointer_type = signature*;
+  using virtuals = typename detail::extract_virtuals<P...>::type;
+
+  static const int classes = sizeof...(Classes);
+  static const int size = detail::power(classes, detail::arity<virtuals>::value);
+
+  template<int Cell>
+  struct cell {
+    template<class Dims>
+    struct at;
+
+    template<int... Dim>
+    struct at<detail::int_sequence<Dim...>> {
+      using type = detail::virtuals<
+        typename detail::nth<Cell / detail::power(classes, Dim) % classes, Classes...>::type...>;
+    };
+
+    using call_classes = typename at<
+      typename detail::make_int_sequence<detail::arity<virtuals>::value>::type
+      >::type;
+
+    using applicable = typename detail::sealed_filter<
+      call_classes, detail::type_list<>, detail::sealed_spec<Specs, R(P...)>...
+      >::type;
+
+    static constexpr method_pointer_type value = detail::sealed_target<
+      signature, typename detail::sealed_select<applicable, applicable>::type
+      >::value;
+  };
+
+  using table = detail::sealed_table<sealed_multi_method, typename detail::make_int_sequence<size>::type>;
+
+  constexpr sealed_multi_method() {}
+
+  R operator ()(typename detail::remove_virtual<P>::type... args) const {
+    (void) &sealed<Classes...>::registered;
+    return table::value[detail::sealed_index<sealed<Classes...>, 0, P...>::value(&args...)](args...);
+  }
+};
+
+template<class... Classes, typename R, typename... P, class... Specs>
+const int sealed_multi_method<sealed<Classes...>, R(P...), Specs...>::classes;
+
+template<class... Classes, typename R, typename... P, class... Specs>
+const int sealed_multi_method<sealed<Classes...>, R(P...), Specs...>::size;
+
+}
+}
+
+#endif
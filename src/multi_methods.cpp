@@ -12,7 +12,14 @@
 #include <iterator>
 #include <string>
 #include <functional>
+#include <random>
 #include <cassert>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <exception>
+#include <system_error>
 
 using namespace std;
 
@@ -43,11 +50,101 @@ ambiguous::ambiguous() :
 
 using class_set = std::unordered_set<const mm_class*>;
 
+// Slots that a class can use without moving its table. Objects point
+// directly at the table, thus it cannot grow past this once objects of the
+// class exist.
+#ifndef YOREL_MM_MMT_CAPACITY
+#define YOREL_MM_MMT_CAPACITY 16
+#endif
+
+// Blocks have room for the adjustments and the header before the entries.
+
+mm_class::table::table() :
+    p(new offset[YOREL_MM_MMT_CAPACITY + 2]() + 2), n(0), capacity(YOREL_MM_MMT_CAPACITY), pinned(false) {
+  p[-1].index = -1;
+  p[-2].adjustments = new adjustment[1]();
+  p[-2].adjustments[0].offset.store(1, std::memory_order_relaxed);
+}
+
+mm_class::table::~table() {
+  delete [] p[-2].adjustments;
+  delete [] (p - 2);
+}
+
+void mm_class::table::resize(int size) {
+  if (size > capacity) {
+    if (pinned.load(std::memory_order_relaxed)) {
+      throw runtime_error(
+          "multi_methods: too many slots for a class that has objects, "
+          "increase YOREL_MM_MMT_CAPACITY");
+    }
+
+    int new_capacity = max(size, 2 * capacity);
+    offset* new_p = new offset[new_capacity + 2]() + 2;
+    copy(p - 2, p + n, new_p - 2);
+    delete [] (p - 2);
+    p = new_p;
+    capacity = new_capacity;
+  }
+
+  n = size;
+}
+
+// Called by initialize(), thus while no calls are in progress.
+
+void mm_class::table::reserve_adjustments(int size) {
+  adjustment* old_adjustments = p[-2].adjustments;
+  int old_size = old_adjustments[0].offset.load(std::memory_order_relaxed);
+
+  if (size <= old_size) {
+    return;
+  }
+
+  adjustment* new_adjustments = new adjustment[size]();
+
+  for (int i = 1; i < old_size; i++) {
+    new_adjustments[i].type.store(old_adjustments[i].type.load(std::memory_order_relaxed), std::memory_order_relaxed);
+    new_adjustments[i].offset.store(old_adjustments[i].offset.load(std::memory_order_relaxed), std::memory_order_relaxed);
+  }
+
+  new_adjustments[0].offset.store(size, std::memory_order_relaxed);
+  p[-2].adjustments = new_adjustments;
+  delete [] old_adjustments;
+}
+
+int mm_class::adjustment_count;
+
+int mm_class::add_adjustment() {
+  return ++adjustment_count;
+}
+
+// Casts registered after the last initialize() have no room yet, and
+// objects of an unregistered class derived from a registered one share
+// its table: in both cases, the offset is not remembered.
+
+void mm_class::set_adjustment(adjustment* adjustments, int i, const std::type_info* type, std::ptrdiff_t offset) {
+  static mutex m;
+  lock_guard<mutex> lock(m);
+
+  if (i > 0 && i < adjustments[0].offset.load(std::memory_order_relaxed)
+      && !adjustments[i].type.load(std::memory_order_relaxed)) {
+    adjustments[i].offset.store(offset, std::memory_order_relaxed);
+    adjustments[i].type.store(type, std::memory_order_release);
+  }
+}
+
 mm_class::mm_class(YOREL_MM_TRACE(const char* name)) : abstract(false), index(-1), root(nullptr) YOREL_MM_COMMA_TRACE(name(name)) {
 }
 
 mm_class::~mm_class() {
+  for (auto& mr : rooted_here) {
+    mr.method->invalidate();
+  }
+
+  remove_from_invalidate(this);
+
   for (mm_class* base : bases) {
+    add_to_invalidate(base);
     base->specs.erase(
         remove_if(base->specs.begin(), base->specs.end(), [=](mm_class* pc) {
             return pc == this;
@@ -55,36 +152,74 @@ mm_class::~mm_class() {
         base->specs.end());
   }
 
-  add_to_initialize(root);
+  remove_from_initialize(this);
+
+  // the root is unknown if the class was never initialized
+  if (root && root != this) {
+    add_to_initialize(root);
+  }
 }
 
-void mm_class::for_each_spec(function<void(mm_class*)> pf) {
-  for_each(specs.begin(), specs.end(),
-           [=](mm_class* p) { p->for_each_conforming(pf); });
+unordered_set<mm_class*>* mm_class::to_invalidate;
+void mm_class::add_to_invalidate(mm_class* pc) {
+  if (!to_invalidate) {
+    to_invalidate = new unordered_set<mm_class*>;
+  }
+
+  to_invalidate->insert(pc);
 }
 
-void mm_class::for_each_conforming(unordered_set<const mm_class*>& visited, function<void(mm_class*)> pf) {
-  if (visited.find(this) == visited.end()) {
-    pf(this);
-    visited.insert(this);
-    for_each(
-        specs.begin(), specs.end(),
-        [=](mm_class* p) { p->for_each_conforming(pf); });
+void mm_class::remove_from_invalidate(mm_class* pc) {
+  if (to_invalidate) {
+    to_invalidate->erase(pc);
+
+    if (to_invalidate->empty()) {
+      delete to_invalidate;
+      to_invalidate = nullptr;
+    }
+  }
+}
+
+// Walk the ancestors of all the classes added or removed since the last
+// initialize() together, visiting each class once.
+void mm_class::invalidate_methods() {
+  if (!to_invalidate) {
+    return;
+  }
+
+  unsigned visited = next_mark();
+  vector<mm_class*> pending(to_invalidate->begin(), to_invalidate->end());
+  delete to_invalidate;
+  to_invalidate = nullptr;
+
+  while (!pending.empty()) {
+    mm_class* pc = pending.back();
+    pending.pop_back();
+
+    if (pc->mark != visited) {
+      pc->mark = visited;
+
+      for (auto& mr : pc->rooted_here) {
+        mr.method->invalidate();
+      }
+
+      pending.insert(pending.end(), pc->bases.begin(), pc->bases.end());
+    }
   }
 }
 
-void mm_class::for_each_conforming(function<void(mm_class*)> pf) {
-  pf(this);
-  for_each(specs.begin(), specs.end(),
-           [=](mm_class* p) { p->for_each_conforming(pf); });
+unsigned mm_class::last_mark;
+unsigned mm_class::next_mark() {
+  return ++last_mark;
 }
 
 bool mm_class::conforms_to(const mm_class& other) const {
-  return index >= other.index && other.mask[index];
+  return (other.low <= low && low <= other.high)
+    || binary_search(extra_bases.begin(), extra_bases.end(), other.low);
 }
 
 bool mm_class::specializes(const mm_class& other) const {
-  return index > other.index && other.mask[index];
+  return this != &other && conforms_to(other);
 }
 
 void mm_class::initialize(const vector<mm_class*>& b) {
@@ -111,13 +246,23 @@ void mm_class::initialize(const vector<mm_class*>& b) {
     pb->specs.push_back(this);
   }
 
-  add_to_initialize(root);
+  // Everything else waits until initialize(): registering N classes at
+  // startup must not cost more than O(N). If the bases are not registered
+  // yet - the order of registration of class templates is unspecified -
+  // the root is found there.
+  if (root) {
+    add_to_initialize(root);
+  }
 
-  root->for_each_conforming([](mm_class* pc) {
-      for (auto& mr : pc->rooted_here) {
-        mr.method->invalidate();
-      }
-    });
+  add_to_invalidate(this);
+}
+
+mm_class* mm_class::find_root() {
+  if (!root) {
+    root = bases.empty() ? this : bases.front()->find_root();
+  }
+
+  return root;
 }
 
 unordered_set<mm_class*>* mm_class::to_initialize;
@@ -155,22 +300,37 @@ void hierarchy_initializer::initialize(mm_class& root) {
   init.execute();
 }
 
-void hierarchy_initializer::topological_sort_visit(std::unordered_set<const mm_class*>& once, mm_class* pc) {
-  if (once.find(pc) == once.end()) {
-    once.insert(pc);
+// Bases first, in depth-first order; 'sorted' marks the classes already
+// in 'nodes' or on the stack.
+void hierarchy_initializer::topological_sort_visit(unsigned sorted, mm_class* pc) {
+  if (pc->mark == sorted) {
+    return;
+  }
 
-    for (mm_class* base : pc->bases) {
-      topological_sort_visit(once, base);
-    }
+  pc->mark = sorted;
+  pending.push_back(make_pair(pc, 0));
+
+  while (!pending.empty()) {
+    auto& top = pending.back();
+
+    if (top.second < top.first->bases.size()) {
+      mm_class* base = top.first->bases[top.second++];
 
-    nodes.push_back(pc);
+      if (base->mark != sorted) {
+        base->mark = sorted;
+        pending.push_back(make_pair(base, 0));
+      }
+    } else {
+      nodes.push_back(top.first);
+      pending.pop_back();
+    }
   }
 }
 
 void hierarchy_initializer::execute() {
   YOREL_MM_TRACE(cout << "assigning slots for hierarchy rooted in " << &root << endl);
   collect_classes();
-  make_masks();
+  number_classes();
   assign_slots();
 
   for (auto pc : nodes) {
@@ -181,29 +341,97 @@ void hierarchy_initializer::execute() {
 }
 
 void hierarchy_initializer::collect_classes() {
-  std::unordered_set<const mm_class*> once;
+  vector<mm_class*> conforming;
   root.for_each_conforming([&](mm_class* pc) {
-      topological_sort_visit(once, pc);
+      conforming.push_back(pc);
     });
+
+  unsigned sorted = mm_class::next_mark();
+
+  for (auto pc : conforming) {
+    topological_sort_visit(sorted, pc);
+  }
 }
 
-void hierarchy_initializer::make_masks() {
-  int mark = 0;
+void hierarchy_initializer::number_classes() {
   const int nb = nodes.size();
+  unsigned in_hierarchy = mm_class::next_mark();
+  int mark = 0;
 
   for (auto pc : nodes) {
-    pc->mask.resize(nb);
     pc->index = mark++;
-    pc->mask[pc->index] = true;
+    pc->mark = in_hierarchy;
+    pc->extra_bases.clear();
+    pc->extra_specs.clear();
   }
 
+  // The first base of each class is its parent in a forest; number the
+  // classes in depth-first order, so that each subtree gets an interval.
+  // Bases come before specs in 'nodes'.
+  auto is_child = [=](const mm_class* pc, const mm_class* spec) {
+    return spec->mark == in_hierarchy && spec->bases.front() == pc;
+  };
+
+  vector<int> subtree_size(nb, 1);
+
   for (auto pc_iter = nodes.rbegin(); pc_iter != nodes.rend(); pc_iter++) {
-    for (mm_class* spec : (*pc_iter)->specs)  {
-      for (int bit = spec->index; bit < nb; bit++) {
-        (*pc_iter)->mask[bit] |= nodes[spec->index]->mask[bit];
+    for (mm_class* spec : (*pc_iter)->specs) {
+      if (is_child(*pc_iter, spec)) {
+        subtree_size[(*pc_iter)->index] += subtree_size[spec->index];
       }
     }
   }
+
+  vector<mm_class*> numbered(nb);
+  int next_root = 0;
+
+  for (auto pc : nodes) {
+    if (pc->bases.empty()) {
+      pc->low = next_root;
+      next_root += subtree_size[pc->index];
+    }
+
+    pc->high = pc->low + subtree_size[pc->index] - 1;
+    numbered[pc->low] = pc;
+    int next = pc->low + 1;
+
+    for (mm_class* spec : pc->specs) {
+      if (is_child(pc, spec)) {
+        spec->low = next;
+        next += subtree_size[spec->index];
+      }
+    }
+  }
+
+  // The classes that a class conforms to, but not through first bases:
+  // what the other bases, and their ancestors up to the first one whose
+  // interval contains the class, contribute.
+  for (auto pc : nodes) {
+    auto contains_pc = [=](const mm_class* other) {
+      return other->low <= pc->low && pc->low <= other->high;
+    };
+
+    for (auto base_iter = pc->bases.begin(); base_iter != pc->bases.end(); base_iter++) {
+      const mm_class* base = *base_iter;
+      copy_if(base->extra_bases.begin(), base->extra_bases.end(), back_inserter(pc->extra_bases),
+              [&](int other) { return !contains_pc(numbered[other]); });
+
+      for (; base_iter != pc->bases.begin() && !contains_pc(base); base = base->bases.front()) {
+        pc->extra_bases.push_back(base->low);
+
+        if (base->bases.empty()) {
+          break;
+        }
+      }
+    }
+
+    sort(pc->extra_bases.begin(), pc->extra_bases.end());
+    pc->extra_bases.erase(unique(pc->extra_bases.begin(), pc->extra_bases.end()), pc->extra_bases.end());
+
+    for (int base : pc->extra_bases) {
+      numbered[base]->extra_specs.push_back(pc->low);
+    }
+  }
 }
 
 void hierarchy_initializer::assign_slots() {
@@ -213,10 +441,14 @@ void hierarchy_initializer::assign_slots() {
     int max_slots = 0;
 
     for (auto& mm : pc->rooted_here) {
+      // a slot is available if no class conforming to pc uses it yet; the
+      // bits are numbered like mm_class::low
       auto available_slot = find_if(
           slots.begin(), slots.end(),
-          [=](const bitvec& mask) {
-            return (mask & pc->mask).none();
+          [=](const bitvec& used) {
+            return !used.any(pc->low, pc->high)
+              && none_of(pc->extra_specs.begin(), pc->extra_specs.end(),
+                         [&](int spec) { return used.any(spec, spec); });
           });
 
       if (available_slot == slots.end()) {
@@ -224,7 +456,11 @@ void hierarchy_initializer::assign_slots() {
         available_slot = slots.end() - 1;
       }
 
-      *available_slot |= pc->mask;
+      available_slot->set(pc->low, pc->high);
+
+      for (int spec : pc->extra_specs) {
+        available_slot->set(spec, spec);
+      }
 
       int slot = available_slot - slots.begin();
       max_slots = max(max_slots, slot + 1);
@@ -242,11 +478,32 @@ void hierarchy_initializer::assign_slots() {
     YOREL_MM_TRACE(cout << pc << ":max inherited slots: " << max_inherited_slots
                    << ", max direct slots: " << max_slots << endl);
 
+    mm_class::offset* storage = pc->mmt.data();
     pc->mmt.resize(max(max_inherited_slots, max_slots));
+    pc->mmt.reserve_adjustments(mm_class::adjustment_count + 1);
+
+    if (pc->mmt.data() != storage) {
+      // compare_dispatch keys on the address of the storage
+      mm_class::add_to_invalidate(pc);
+    }
   }
 }
 
 void initialize() {
+  if (!mm_class::to_initialize && !mm_class::to_invalidate && !multi_method_base::to_initialize) {
+    return;
+  }
+
+  if (mm_class::to_invalidate) {
+    for (auto pc : *mm_class::to_invalidate) {
+      if (!pc->root) {
+        mm_class::add_to_initialize(pc->find_root());
+      }
+    }
+  }
+
+  mm_class::invalidate_methods();
+
   while (mm_class::to_initialize) {
     auto pc = *mm_class::to_initialize->begin();
     if (pc->is_root()) {
@@ -256,11 +513,17 @@ void initialize() {
     }
   }
 
+  mm_class::invalidate_methods();
+
   while (multi_method_base::to_initialize) {
     auto pm = *multi_method_base::to_initialize->begin();
     pm->resolve();
     multi_method_base::remove_from_initialize(pm);
   }
+
+  get_mm_table<false>::make_hash_table();
+  tag_table::make_all();
+  ++multi_method_base::generation;
 }
 
 method_base::~method_base() {
@@ -301,6 +564,288 @@ void mm_class::remove_multi_method(multi_method_base* pm) {
 
 get_mm_table<false>::class_of_type* get_mm_table<false>::class_of;
 
+namespace {
+get_mm_table<false>::entry no_foreign_classes[1];
+}
+
+get_mm_table<false>::entry* get_mm_table<false>::hash_table = no_foreign_classes;
+uintptr_t get_mm_table<false>::hash_mult;
+int get_mm_table<false>::hash_shift;
+
+const mm_class::offset* get_mm_table<false>::slow_value(const type_info& ti) {
+  if (class_of) {
+    auto cls = class_of->find(type_index(ti));
+
+    if (cls != class_of->end()) {
+      return cls->second.mmt->data();
+    }
+  }
+
+  throw runtime_error(string("multi_methods: class not registered: ") + ti.name());
+}
+
+void get_mm_table<false>::make_hash_table() {
+  if (hash_table != no_foreign_classes) {
+    delete [] hash_table;
+  }
+
+  hash_table = no_foreign_classes;
+  hash_mult = 0;
+  hash_shift = 0;
+
+  if (!class_of || class_of->empty()) {
+    return;
+  }
+
+  // Look for a multiplier that sends every registered type_info to a
+  // different bucket; make the table bigger when it's hard to find.
+  const int digits = numeric_limits<uintptr_t>::digits;
+  int bits = 1;
+
+  while ((size_t(1) << bits) < class_of->size()) {
+    ++bits;
+  }
+
+  mt19937_64 random;
+  vector<bool> used;
+
+  for (bool found = false; !found; ++bits) {
+    used.assign(size_t(1) << bits, false);
+    hash_shift = digits - bits;
+
+    for (int attempt = 0; !found && attempt < 100; ++attempt) {
+      hash_mult = static_cast<uintptr_t>(random()) | 1;
+      fill(used.begin(), used.end(), false);
+      found = all_of(
+          class_of->begin(), class_of->end(),
+          [&](const class_of_type::value_type& cls) {
+            vector<bool>::reference bucket = used[hash(*cls.second.type)];
+
+            if (bucket) {
+              return false;
+            }
+
+            bucket = true;
+            return true;
+          });
+    }
+
+    if (found) {
+      hash_table = new entry[used.size()]();
+
+      for (auto& cls : *class_of) {
+        entry& e = hash_table[hash(*cls.second.type)];
+        e.key = cls.second.type;
+        e.mmt = cls.second.mmt->data();
+      }
+
+      YOREL_MM_TRACE(cout << "foreign classes: " << class_of->size()
+                     << ", hash table size: " << used.size() << endl);
+    }
+  }
+}
+
+vector<tag_table*>* tag_table::all;
+
+void tag_table::add(int tag, mm_class& pc) {
+  if (tag < 0) {
+    throw runtime_error("multi_methods: negative class tag");
+  }
+
+  if (!classes) {
+    classes = new vector<pair<int, const mm_class::table*>>;
+
+    if (!all) {
+      all = new vector<tag_table*>;
+    }
+
+    all->push_back(this);
+  }
+
+  classes->push_back(make_pair(tag, &pc.mmt));
+  mm_class::add_to_initialize(&pc);
+}
+
+void tag_table::make() {
+  delete [] mmts;
+  size = 0;
+
+  for (auto& tagged : *classes) {
+    size = max(size, tagged.first + 1);
+  }
+
+  mmts = new const mm_class::offset*[size]();
+
+  for (auto& tagged : *classes) {
+    mmts[tagged.first] = tagged.second->data();
+  }
+}
+
+void tag_table::make_all() {
+  if (all) {
+    for (tag_table* table : *all) {
+      table->make();
+    }
+  }
+}
+
+namespace {
+
+struct parallel_job {
+  size_t n;
+  size_t chunk;
+  parallel_body body;
+  void* context;
+  atomic<size_t> cursor;
+  vector<exception_ptr> errors;
+
+  void work(unsigned worker) {
+    try {
+      for (;;) {
+        size_t begin = cursor.fetch_add(chunk);
+
+        if (begin >= n) {
+          break;
+        }
+
+        body(context, worker, begin, min(n, begin + chunk));
+      }
+    } catch (...) {
+      errors[worker] = current_exception();
+      cursor = n;
+    }
+  }
+};
+
+// Whether the current thread works on a job: then run_parallel_chunks()
+// is called from a body, and the job runs in this thread only.
+thread_local bool in_job = false;
+
+// The threads that help the caller of run_parallel_chunks(). Thread i
+// works as worker i + 1, when the job has that many workers. One job runs
+// at a time; callers from other threads wait for their turn.
+class worker_pool {
+ public:
+  ~worker_pool();
+  void run(parallel_job& job, unsigned workers);
+
+ private:
+  void serve(unsigned worker, size_t seen);
+
+  mutex busy;    // held by the caller of run() for the duration of a job
+  mutex lock;    // protects the members below
+  condition_variable wake, done;
+  vector<thread> threads;
+  parallel_job* current = nullptr;
+  unsigned helpers = 0; // threads working on 'current'
+  unsigned active = 0;  // of which not finished yet
+  size_t generation = 0;
+  bool stopping = false;
+};
+
+worker_pool::~worker_pool() {
+  {
+    lock_guard<mutex> guard(lock);
+    stopping = true;
+  }
+
+  wake.notify_all();
+
+  for (auto& t : threads) {
+    t.join();
+  }
+}
+
+void worker_pool::run(parallel_job& job, unsigned workers) {
+  lock_guard<mutex> owner(busy);
+
+  {
+    lock_guard<mutex> guard(lock);
+
+    while (threads.size() + 1 < workers) {
+      try {
+        threads.emplace_back(&worker_pool::serve, this, unsigned(threads.size() + 1), generation);
+      } catch (system_error&) {
+        // out of threads, make do with those we have
+        break;
+      }
+    }
+
+    current = &job;
+    helpers = min<size_t>(workers - 1, threads.size());
+    active = helpers;
+    ++generation;
+  }
+
+  wake.notify_all();
+  in_job = true;
+  job.work(0);
+  in_job = false;
+
+  unique_lock<mutex> guard(lock);
+  done.wait(guard, [this]() { return active == 0; });
+  current = nullptr;
+}
+
+void worker_pool::serve(unsigned worker, size_t seen) {
+  in_job = true;
+  unique_lock<mutex> guard(lock);
+
+  for (;;) {
+    wake.wait(guard, [&]() { return stopping || generation != seen; });
+
+    if (stopping) {
+      return;
+    }
+
+    seen = generation;
+
+    if (worker > helpers) {
+      continue;
+    }
+
+    parallel_job& job = *current;
+    guard.unlock();
+    job.work(worker);
+    guard.lock();
+
+    if (--active == 0) {
+      done.notify_one();
+    }
+  }
+}
+
+}
+
+unsigned detail::parallel_workers(size_t n) {
+  unsigned workers = max(1u, thread::hardware_concurrency());
+  return n < workers ? max<size_t>(1, n) : workers;
+}
+
+void detail::run_parallel_chunks(size_t n, unsigned workers, parallel_body body, void* context) {
+  static worker_pool pool;
+
+  parallel_job job;
+  job.n = n;
+  job.chunk = max<size_t>(1, n / (workers * 8));
+  job.body = body;
+  job.context = context;
+  job.cursor = 0;
+  job.errors.resize(workers);
+
+  if (workers > 1 && !in_job) {
+    pool.run(job, workers);
+  } else {
+    job.work(0);
+  }
+
+  for (auto& error : job.errors) {
+    if (error) {
+      rethrow_exception(error);
+    }
+  }
+}
+
 ostream& operator <<(ostream& os, const vector<mm_class*>& classes) {
   using namespace std;
   const char* sep = "(";
@@ -314,14 +859,17 @@ ostream& operator <<(ostream& os, const vector<mm_class*>& classes) {
   return os << ")";
 }
 
-multi_method_base::multi_method_base(const vector<mm_class*>& v YOREL_MM_COMMA_TRACE(const char* name))
-  : vargs(v) YOREL_MM_COMMA_TRACE(name(name)) {
+multi_method_base::multi_method_base(
+  const vector<mm_class*>& v, int* slots_strides YOREL_MM_COMMA_TRACE(const char* name),
+  resolver resolve_with, void_function_pointer* direct)
+  : vargs(v), slots_strides(slots_strides), resolve_with(resolve_with), direct(direct) YOREL_MM_COMMA_TRACE(name(name)) {
   int i = 0;
   for (auto pc : vargs) {
     YOREL_MM_TRACE(cout << "add " << name << " rooted in " << pc->name << " argument " << i << "\n");
     pc->add_multi_method(this, i++);
   }
   slots.resize(v.size());
+  invalidate();
 }
 
 multi_method_base::~multi_method_base() {
@@ -338,8 +886,10 @@ multi_method_base::~multi_method_base() {
 }
 
 void multi_method_base::assign_slot(int arg, int slot) {
-  slots[arg] = slot;
-  invalidate();
+  if (slots[arg] != slot) {
+    slots[arg] = slot;
+    invalidate();
+  }
 }
 
 void multi_method_base::invalidate() {
@@ -348,6 +898,7 @@ void multi_method_base::invalidate() {
 }
 
 unordered_set<multi_method_base*>* multi_method_base::to_initialize;
+size_t multi_method_base::generation = 1;
 
 void multi_method_base::add_to_initialize(multi_method_base* pm) {
   if (!to_initialize) {
@@ -369,11 +920,69 @@ void multi_method_base::remove_from_initialize(multi_method_base* pm) {
 }
 
 void multi_method_base::resolve() {
-  grouping_resolver r(*this);
+  resolve_with(*this);
+
+  for (auto target : final_targets) {
+    target->store(nullptr, memory_order_relaxed);
+  }
+}
+
+void multi_method_base::add_final_target(atomic<void_function_pointer>* target) {
+  // calls on different final classes may register concurrently
+  static mutex registering;
+  lock_guard<mutex> guard(registering);
+  final_targets.push_back(target);
+}
+
+void grouped_dispatch::resolve(multi_method_base& mm) {
+  grouping_resolver r(mm);
   r.resolve();
 }
 
-grouping_resolver::grouping_resolver(multi_method_base& mm) : mm(mm), dims(mm.vargs.size()) {
+void dense_dispatch::resolve(multi_method_base& mm) {
+  grouping_resolver r(mm, false);
+  r.resolve();
+}
+
+void compare_dispatch::resolve(multi_method_base& mm) {
+  grouping_resolver r(mm);
+  r.resolve();
+
+  const int dims = mm.vargs.size();
+
+  for (int dim = 0; dim < dims; ++dim) {
+    auto& dim_keys = mm.keys[dim];
+    const int slot = mm.slots[dim];
+    const int stride = mm.slots_strides[2 * dim + 1];
+    int classes = 0;
+
+    for (auto& group : r.groups[dim]) {
+      classes += group.classes.size();
+    }
+
+    dim_keys.count = 0;
+
+    if (classes > compare_keys::size) {
+      continue;
+    }
+
+    for (auto& group : r.groups[dim]) {
+      for (auto pc : group.classes) {
+        dim_keys.tables[dim_keys.count] = pc->mmt.data();
+        dim_keys.entries[dim_keys.count] = pc->mmt[slot];
+
+        if (dim > 0) {
+          dim_keys.entries[dim_keys.count].index *= stride;
+        }
+
+        ++dim_keys.count;
+      }
+    }
+  }
+}
+
+grouping_resolver::grouping_resolver(multi_method_base& mm, bool merge) :
+    mm(mm), dims(mm.vargs.size()), merge(merge) {
 }
 
 void grouping_resolver::resolve() {
@@ -386,34 +995,78 @@ void grouping_resolver::make_groups() {
   groups.resize(dims);
 
   int dim = 0;
-  mm.steps.resize(dims);
   int step = 1;
 
   for (auto& dim_groups : groups) {
     YOREL_MM_TRACE(cout << "make_groups dim = " << dim << endl);
 
-    unordered_set<const mm_class*> once;
-    mm.steps[dim] = step;
-
-    mm.vargs[dim]->for_each_conforming(once, [&](mm_class* pc) {
-        group g;
-        find_applicable(dim, pc, g.methods);
-        g.classes.push_back(pc);
-        make_mask(g.methods, g.mask);
-        YOREL_MM_TRACE(cout << pc << " has " << g.methods << endl);
-        auto lower = lower_bound(
-            dim_groups.begin(), dim_groups.end(), g,
-            []( const group& g1, const group& g2) { return g1.mask < g2.mask; });
-
-        if (lower == dim_groups.end() || g.mask < lower->mask) {
-          YOREL_MM_TRACE(cout << "create new group" << endl);
-          dim_groups.insert(lower, g);
-        } else {
-          YOREL_MM_TRACE(cout << "add " << pc << " to existing group " << lower->methods << endl);
-          lower->classes.push_back(pc);
-        }
+    mm.slots_strides[2 * dim] = mm.slots[dim];
+    mm.slots_strides[2 * dim + 1] = step;
+
+    vector<mm_class*> conforming;
+    mm.vargs[dim]->for_each_conforming([&](mm_class* pc) {
+        conforming.push_back(pc);
       });
 
+    // The specializations applicable to a class are those declared for it,
+    // plus those applicable to its bases: compute them bases first, a word
+    // at a time.
+    vector<mm_class*> sorted(conforming);
+    sort(sorted.begin(), sorted.end(), [](const mm_class* a, const mm_class* b) {
+        return a->index < b->index;
+      });
+
+    unsigned in_dim = mm_class::next_mark();
+    vector<bitvec> applicable(sorted.empty() ? 0 : sorted.back()->index + 1);
+
+    for (auto pc : sorted) {
+      pc->mark = in_dim;
+      applicable[pc->index].resize(mm.methods.size());
+    }
+
+    for (auto pm : mm.methods) {
+      if (pm->args[dim]->mark == in_dim) {
+        applicable[pm->args[dim]->index][pm->index] = true;
+      }
+    }
+
+    for (auto pc : sorted) {
+      for (auto base : pc->bases) {
+        if (base->mark == in_dim) {
+          applicable[pc->index] |= applicable[base->index];
+        }
+      }
+    }
+
+    for (auto pc : conforming) {
+      group g;
+      g.mask = move(applicable[pc->index]);
+      g.classes.push_back(pc);
+
+      for (int i = g.mask.find_first(); i != bitvec::npos; i = g.mask.find_next(i)) {
+        g.methods.push_back(mm.methods[i]);
+      }
+
+      YOREL_MM_TRACE(cout << pc << " has " << g.methods << endl);
+
+      if (!merge) {
+        dim_groups.push_back(move(g));
+        continue;
+      }
+
+      auto lower = lower_bound(
+          dim_groups.begin(), dim_groups.end(), g,
+          []( const group& g1, const group& g2) { return g1.mask < g2.mask; });
+
+      if (lower == dim_groups.end() || g.mask < lower->mask) {
+        YOREL_MM_TRACE(cout << "create new group" << endl);
+        dim_groups.insert(lower, move(g));
+      } else {
+        YOREL_MM_TRACE(cout << "add " << pc << " to existing group " << lower->methods << endl);
+        lower->classes.push_back(pc);
+      }
+    }
+
     step *= dim_groups.size();
 
     YOREL_MM_TRACE(cout << "assign slots" << endl);
@@ -438,8 +1091,16 @@ void grouping_resolver::make_table() {
   YOREL_MM_TRACE(cout << "Creating dispatch table for " << mm.name << endl);
 
   emit_at = 0;
+  single = nullptr;
+  narrowed.resize(dims);
   resolve(dims - 1, ~bitvec(mm.methods.size()));
 
+  // Direct calls are safe only if every cell holds the same
+  // specialization: otherwise, some calls must throw undefined or
+  // ambiguous, or go to another specialization.
+  *mm.direct = single && single != &method_base::undefined && single != &method_base::ambiguous
+    ? dispatch_table[0] : nullptr;
+
   const int first_slot = mm.slots[0];
 
   bitvec once;
@@ -452,7 +1113,12 @@ void grouping_resolver::make_table() {
 
       if (!once[pc->index]) {
         once[pc->index] = true;
-        pc->mmt[first_slot].ptr = dispatch_table + pc->mmt[first_slot].index;
+
+        if (dims == 1) {
+          pc->mmt[first_slot].pf = dispatch_table[pc->mmt[first_slot].index];
+        } else {
+          pc->mmt[first_slot].ptr = dispatch_table + pc->mmt[first_slot].index;
+        }
       }
     }
   }
@@ -462,13 +1128,23 @@ void grouping_resolver::resolve(int dim, const bitvec& candidates) {
   using namespace std;
   YOREL_MM_TRACE(cout << "resolve dim = " << dim << endl);
 
+  bitvec& group_candidates = narrowed[dim];
+
   for (auto& group : groups[dim]) {
+    and_into(group_candidates, candidates, group.mask);
+
     if (dim == 0) {
-      method_base* best = find_best(candidates & group.mask);
+      method_base* best = find_best(group_candidates);
       YOREL_MM_TRACE(cout << "install " << best << " at offset " << emit_at << endl);
       mm.emit(best, emit_at++);
+
+      if (emit_at == 1) {
+        single = best;
+      } else if (best != single) {
+        single = nullptr;
+      }
     } else {
-      resolve(dim - 1, candidates & group.mask);
+      resolve(dim - 1, group_candidates);
     }
   }
 
@@ -508,17 +1184,23 @@ method_base* grouping_resolver::find_best(const vector<method_base*>& candidates
 }
 
 method_base* grouping_resolver::find_best(const bitvec& mask) {
+  int first = mask.find_first();
+
+  if (first == bitvec::npos) {
+    return &method_base::undefined;
+  }
+
+  if (mask.find_next(first) == bitvec::npos) {
+    return mm.methods[first];
+  }
+
   vector<method_base*> candidates;
-  copy_if(mm.methods.begin(), mm.methods.end(), back_inserter(candidates),
-          [&](method_base* method) { return mask[method->index]; });
-  return find_best(candidates);
-}
 
-void grouping_resolver::find_applicable(int dim, const mm_class* pc, vector<method_base*>& methods) {
-  copy_if(
-      mm.methods.begin(), mm.methods.end(),
-      back_inserter(methods),
-      [=](method_base* pm) { return pc->conforms_to(*pm->args[dim]); });
+  for (int i = first; i != bitvec::npos; i = mask.find_next(i)) {
+    candidates.push_back(mm.methods[i]);
+  }
+
+  return find_best(candidates);
 }
 
 void grouping_resolver::assign_next() {
@@ -537,14 +1219,6 @@ void grouping_resolver::assign_next() {
   }
 }
 
-void grouping_resolver::make_mask(const vector<method_base*>& methods, bitvec& mask) {
-  mask.resize(mm.methods.size());
-
-  for (auto pm : methods) {
-    mask[pm->index] = true;
-  }
-}
-
 #ifdef YOREL_MM_ENABLE_TRACE
 
 std::ostream& operator <<(std::ostream& os, const mm_class* pc) {
@@ -39,12 +39,22 @@
 #include <iostream>
 #include <iomanip>
 #include <chrono>
+#include <cmath>
+#include <vector>
+#include <algorithm>
+#include <random>
+#include <string>
+#include <memory>
 #include "benchmarks.hpp"
 
 using namespace std;
 using namespace std::chrono;
 using yorel::multi_methods::virtual_;
 
+// Each multi-method has a specialization for a derived class that the
+// benchmarks do not call, otherwise it would be called directly, without
+// dispatch.
+
 namespace intrusive {
 
 MULTI_METHOD(do_nothing, void, virtual_<object>&);
@@ -52,17 +62,41 @@ MULTI_METHOD(do_nothing, void, virtual_<object>&);
 BEGIN_SPECIALIZATION(do_nothing, void, object&) {
 } END_SPECIALIZATION;
 
+BEGIN_SPECIALIZATION(do_nothing, void, leaf&) {
+} END_SPECIALIZATION;
+
 MULTI_METHOD(do_something, double, virtual_<object>&, double x, double a, double b, double c);
 
 BEGIN_SPECIALIZATION(do_something, double, object&, double x, double a, double b, double c) {
   return log(a * x * x + b * x + c);
 } END_SPECIALIZATION;
 
+BEGIN_SPECIALIZATION(do_something, double, leaf&, double x, double a, double b, double c) {
+  return log(a * x * x + b * x + c);
+} END_SPECIALIZATION;
+
 MULTI_METHOD(do_nothing_2, void, virtual_<object>&, virtual_<object>&);
 
 BEGIN_SPECIALIZATION(do_nothing_2, void, object&, object&) {
 } END_SPECIALIZATION;
 
+BEGIN_SPECIALIZATION(do_nothing_2, void, leaf&, leaf&) {
+} END_SPECIALIZATION;
+
+MULTI_METHOD_WITH_POLICY(do_nothing_2_compare, yorel::multi_methods::compare_dispatch, void, virtual_<object>&, virtual_<object>&);
+
+BEGIN_SPECIALIZATION(do_nothing_2_compare, void, object&, object&) {
+} END_SPECIALIZATION;
+
+BEGIN_SPECIALIZATION(do_nothing_2_compare, void, leaf&, leaf&) {
+} END_SPECIALIZATION;
+
+// has a single specialization, thus is called directly
+MULTI_METHOD(do_nothing_direct, void, virtual_<object>&);
+
+BEGIN_SPECIALIZATION(do_nothing_direct, void, object&) {
+} END_SPECIALIZATION;
+
 }
 
 namespace vbase {
@@ -72,8 +106,15 @@ MULTI_METHOD(do_nothing, void, virtual_<object>&);
 BEGIN_SPECIALIZATION(do_nothing, void, object&) {
 } END_SPECIALIZATION;
 
+BEGIN_SPECIALIZATION(do_nothing, void, derived&) {
+} END_SPECIALIZATION;
+
 MULTI_METHOD(do_something, double, virtual_<object>&, double x, double a, double b, double c);
 
+BEGIN_SPECIALIZATION(do_something, double, object&, double x, double a, double b, double c) {
+  return log(a * x * x + b * x + c);
+} END_SPECIALIZATION;
+
 BEGIN_SPECIALIZATION(do_something, double, derived&, double x, double a, double b, double c) {
   return log(a * x * x + b * x + c);
 } END_SPECIALIZATION;
@@ -83,6 +124,9 @@ MULTI_METHOD(do_nothing_2, void, virtual_<object>&, virtual_<object>&);
 BEGIN_SPECIALIZATION(do_nothing_2, void, object&, object&) {
 } END_SPECIALIZATION;
 
+BEGIN_SPECIALIZATION(do_nothing_2, void, derived&, derived&) {
+} END_SPECIALIZATION;
+
 }
 
 namespace foreign {
@@ -93,21 +137,134 @@ struct object {
 
 MM_FOREIGN_CLASS(object);
 
+struct derived : object {
+};
+
+MM_FOREIGN_CLASS(derived, object);
+
 MULTI_METHOD(do_nothing, void, virtual_<object>&);
 
 BEGIN_SPECIALIZATION(do_nothing, void, object&) {
 } END_SPECIALIZATION;
 
+BEGIN_SPECIALIZATION(do_nothing, void, derived&) {
+} END_SPECIALIZATION;
+
 MULTI_METHOD(do_nothing_2, void, virtual_<object>&, virtual_<object>&);
 
 BEGIN_SPECIALIZATION(do_nothing_2, void, object&, object&) {
 } END_SPECIALIZATION;
 
+BEGIN_SPECIALIZATION(do_nothing_2, void, derived&, derived&) {
+} END_SPECIALIZATION;
+
 MULTI_METHOD(do_something, double, virtual_<object>&, double x, double a, double b, double c);
 
 BEGIN_SPECIALIZATION(do_something, double, object&, double x, double a, double b, double c) {
   return log(a * x * x + b * x + c);
 } END_SPECIALIZATION;
+
+BEGIN_SPECIALIZATION(do_something, double, derived&, double x, double a, double b, double c) {
+  return log(a * x * x + b * x + c);
+} END_SPECIALIZATION;
+}
+
+namespace tagged {
+
+struct object {
+  object() : kind(0) { }
+  virtual ~object() { }
+  int kind;
+};
+
+MM_FOREIGN_TAGGED_ROOT(object, &object::kind);
+MM_FOREIGN_CLASS(object);
+MM_FOREIGN_CLASS_TAG(object, 0);
+
+struct derived : object {
+  derived() { kind = 1; }
+};
+
+MM_FOREIGN_CLASS(derived, object);
+MM_FOREIGN_CLASS_TAG(derived, 1);
+
+MULTI_METHOD(do_nothing, void, virtual_<object>&);
+
+BEGIN_SPECIALIZATION(do_nothing, void, object&) {
+} END_SPECIALIZATION;
+
+BEGIN_SPECIALIZATION(do_nothing, void, derived&) {
+} END_SPECIALIZATION;
+
+MULTI_METHOD(do_nothing_2, void, virtual_<object>&, virtual_<object>&);
+
+BEGIN_SPECIALIZATION(do_nothing_2, void, object&, object&) {
+} END_SPECIALIZATION;
+
+BEGIN_SPECIALIZATION(do_nothing_2, void, derived&, derived&) {
+} END_SPECIALIZATION;
+}
+
+// a chain of classes, and a method with a specialization for each pair
+namespace many_specs {
+
+const int depth = 18;
+
+template<int I>
+struct node;
+
+template<>
+struct node<0> : yorel::multi_methods::selector {
+  MM_CLASS(node);
+
+  node() {
+    MM_INIT();
+  }
+};
+
+template<int I>
+struct node : node<I - 1> {
+  MM_CLASS(node, node<I - 1>);
+
+  node() {
+    MM_INIT();
+  }
+};
+
+MULTI_METHOD(visit, void, virtual_<node<0>>&, virtual_<node<0>>&);
+
+using method = std::remove_const<decltype(visit)>::type;
+
+template<int I, int J>
+struct visit_spec : method::specialization<visit_spec<I, J>> {
+  using body_signature = yorel::multi_methods::detail::signature<void(node<I>&, node<J>&)>;
+  static void body(node<I>&, node<J>&) {
+  }
+};
+
+template<int I, int J>
+struct specialize_all {
+  static void apply() {
+    method::specialize<visit_spec<I, J>>();
+    specialize_all<I, J - 1>::apply();
+  }
+};
+
+template<int I>
+struct specialize_all<I, 0> {
+  static void apply() {
+    method::specialize<visit_spec<I, 0>>();
+    specialize_all<I - 1, depth - 1>::apply();
+  }
+};
+
+template<>
+struct specialize_all<0, 0> {
+  static void apply() {
+    method::specialize<visit_spec<0, 0>>();
+  }
+};
+
 }
 
 using time_type = decltype(high_resolution_clock::now());
@@ -138,7 +295,9 @@ int main() {
 
   {
     auto pf = new foreign::object;
+    auto pt = new tagged::object;
     auto pi = intrusive::object::make();
+    auto pl = new intrusive::leaf;
 
     cout << repeats << " iterations, time in millisecs\n";
 
@@ -154,12 +313,43 @@ int main() {
         intrusive::do_nothing(*pi);
     }
 
+    {
+      benchmark b("open method, intrusive, direct, do_nothing");
+      for (int i = 0; i < repeats; i++)
+        intrusive::do_nothing_direct(*pi);
+    }
+
+    {
+      benchmark b("open method, intrusive, leaf, do_nothing");
+      intrusive::object& obj = *pl;
+      for (int i = 0; i < repeats; i++)
+        intrusive::do_nothing(obj);
+    }
+
+    {
+      benchmark b("open method, intrusive, final, do_nothing");
+      for (int i = 0; i < repeats; i++)
+        intrusive::do_nothing(*pl);
+    }
+
     {
       benchmark b("open method, foreign, do_nothing");
       for (int i = 0; i < repeats; i++)
         foreign::do_nothing(*pf);
     }
 
+    {
+      benchmark b("open method, foreign, cached, do_nothing");
+      for (int i = 0; i < repeats; i++)
+        MM_CACHED_CALL(foreign::do_nothing, *pf);
+    }
+
+    {
+      benchmark b("open method, foreign, tagged, do_nothing");
+      for (int i = 0; i < repeats; i++)
+        tagged::do_nothing(*pt);
+    }
+
     {
       benchmark b("virtual function, do_something");
       for (int i = 0; i < repeats; i++)
@@ -192,11 +382,65 @@ int main() {
         intrusive::do_nothing_2(*pi, *pi);
     }
 
+    {
+      benchmark b("open method, 2 args, compare, do_nothing");
+      for (int i = 0; i < repeats; i++)
+        intrusive::do_nothing_2_compare(*pi, *pi);
+    }
+
     {
       benchmark b("open method with 2 args, foreign, do_nothing");
       for (int i = 0; i < repeats; i++)
         foreign::do_nothing_2(*pf, *pf);
     }
+
+    {
+      benchmark b("open method, 2 args, foreign, cached, do_nothing");
+      for (int i = 0; i < repeats; i++)
+        MM_CACHED_CALL(foreign::do_nothing_2, *pf, *pf);
+    }
+
+    {
+      benchmark b("open method, 2 args, foreign, tagged, do_nothing");
+      for (int i = 0; i < repeats; i++)
+        tagged::do_nothing_2(*pt, *pt);
+    }
+
+    {
+      auto h = intrusive::do_nothing_2.resolve(*pi, *pi);
+      benchmark b("open method, 2 args, resolved, do_nothing");
+      for (int i = 0; i < repeats; i++)
+        h(*pi, *pi);
+    }
+
+    {
+      benchmark b("open method, 2 args, final, do_nothing");
+      for (int i = 0; i < repeats; i++)
+        intrusive::do_nothing_2(*pl, *pl);
+    }
+
+    {
+      auto h = intrusive::do_nothing_2.bind(*pi);
+      benchmark b("open method, 2 args, bound, do_nothing");
+      for (int i = 0; i < repeats; i++)
+        h(*pi);
+    }
+
+    const int side = sqrt(repeats);
+    vector<intrusive::object*> objects(side, pi);
+
+    {
+      benchmark b("open method, 2 args, nested loops, do_nothing");
+      for (auto a : objects)
+        for (auto b : objects)
+          intrusive::do_nothing_2(*a, *b);
+    }
+
+    {
+      benchmark b("open method, 2 args, for_each_pair, do_nothing");
+      intrusive::do_nothing_2.for_each_pair(
+        objects.begin(), objects.end(), objects.begin(), objects.end());
+    }
   }
 
   // virtual inheritance
@@ -242,5 +486,78 @@ int main() {
     }
   }
 
+  // working set larger than the caches
+  {
+    const int count = 4 * 1024 * 1024;
+    const int distance = 16;
+    vector<intrusive::object*> objects(count);
+
+    for (auto& p : objects)
+      p = intrusive::object::make();
+
+    shuffle(objects.begin(), objects.end(), mt19937());
+
+    {
+      benchmark b("open method, scattered objects, do_nothing");
+      for (int i = 0; i < count; i++)
+        intrusive::do_nothing(*objects[i]);
+    }
+
+    {
+      benchmark b("open method, scattered objects, prefetch");
+      for (int i = 0; i < count; i++) {
+        if (i + 2 * distance < count)
+          YOREL_MM_PREFETCH(objects[i + 2 * distance]);
+        if (i + distance < count)
+          intrusive::do_nothing.prefetch(*objects[i + distance]);
+        intrusive::do_nothing(*objects[i]);
+      }
+    }
+
+    {
+      benchmark b("open method, scattered objects, direct");
+      for (int i = 0; i < count; i++)
+        intrusive::do_nothing_direct(*objects[i]);
+    }
+  }
+
+  // dispatch table of a method with many specializations
+  {
+    many_specs::node<many_specs::depth - 1> last;
+    many_specs::specialize_all<many_specs::depth - 1, many_specs::depth - 1>::apply();
+    yorel::multi_methods::initialize();
+
+    benchmark b("resolve 2 args, 324 specializations, 100 times");
+    for (int i = 0; i < 100; i++)
+      many_specs::visit.the().resolve();
+  }
+
+  // startup: registering a generated hierarchy, as MM_INIT() does before
+  // main(); each class derives from the previous one
+  for (int count = 1250; count <= 5000; count *= 2) {
+    using yorel::multi_methods::mm_class;
+    vector<unique_ptr<mm_class>> classes(count);
+
+    {
+      benchmark b("register " + to_string(count) + " classes");
+      for (int i = 0; i < count; i++) {
+        classes[i].reset(new mm_class);
+        if (i == 0)
+          classes[i]->initialize({});
+        else
+          classes[i]->initialize({ classes[i - 1].get() });
+      }
+    }
+
+    {
+      benchmark b("initialize " + to_string(count) + " classes");
+      yorel::multi_methods::initialize();
+    }
+
+    // derived classes first, so that they unregister from their bases
+    while (!classes.empty())
+      classes.pop_back();
+  }
+
   return 0;
 }
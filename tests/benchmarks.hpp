@@ -24,6 +24,15 @@ struct object : yorel::multi_methods::selector {
   virtual void dd2_do_nothing(object* pf);
 };
 
+struct leaf final : object {
+
+  MM_CLASS(leaf, object);
+
+  leaf() {
+    MM_INIT();
+  }
+};
+
 }
 
 namespace vbase {
@@ -14,10 +14,16 @@
 
 #include <yorel/multi_methods.hpp>
 #include <yorel/multi_methods/runtime.hpp>
+#include <yorel/multi_methods/sealed.hpp>
 
 #include <iostream>
 #include <iomanip>
 #include <sstream>
+#include <algorithm>
+#include <atomic>
+#include <random>
+#include <memory>
+#include <thread>
 
 #include "util/join.hpp"
 
@@ -85,6 +91,22 @@ unsigned long binary(const char* digits) {
   return bits;
 }
 
+// classes registered at runtime, destroyed derived first so that each one
+// unregisters from live bases
+struct runtime_classes : vector<unique_ptr<mm_class>> {
+  mm_class* add(const vector<mm_class*>& bases) {
+    emplace_back(new mm_class);
+    back()->initialize(bases);
+    return back().get();
+  }
+
+  ~runtime_classes() {
+    while (!empty()) {
+      pop_back();
+    }
+  }
+};
+
 DO {
   cout << boolalpha;
 }
@@ -202,8 +224,194 @@ BEGIN_SPECIALIZATION(display, action, const Animal& a, const Mobile& b) {
 
 }
 
+namespace dispatch_policies {
+
+#include "animals.hpp"
+
+MULTI_METHOD(encounter, string, const virtual_<Animal>&, const virtual_<Animal>&);
+
+BEGIN_SPECIALIZATION(encounter, string, const Animal&, const Animal&) {
+  return "ignore";
+} END_SPECIALIZATION;
+
+BEGIN_SPECIALIZATION(encounter, string, const Herbivore&, const Carnivore&) {
+  return "run";
+} END_SPECIALIZATION;
+
+BEGIN_SPECIALIZATION(encounter, string, const Carnivore&, const Herbivore&) {
+  return "hunt";
+} END_SPECIALIZATION;
+
+BEGIN_SPECIALIZATION(encounter, string, const Carnivore&, const Carnivore&) {
+  return "fight";
+} END_SPECIALIZATION;
+
+MULTI_METHOD_WITH_POLICY(encounter_dense, dense_dispatch, string, const virtual_<Animal>&, const virtual_<Animal>&);
+
+BEGIN_SPECIALIZATION(encounter_dense, string, const Animal&, const Animal&) {
+  return "ignore";
+} END_SPECIALIZATION;
+
+BEGIN_SPECIALIZATION(encounter_dense, string, const Herbivore&, const Carnivore&) {
+  return "run";
+} END_SPECIALIZATION;
+
+BEGIN_SPECIALIZATION(encounter_dense, string, const Carnivore&, const Herbivore&) {
+  return "hunt";
+} END_SPECIALIZATION;
+
+BEGIN_SPECIALIZATION(encounter_dense, string, const Carnivore&, const Carnivore&) {
+  return "fight";
+} END_SPECIALIZATION;
+
+// more classes than compare_keys::size: uses the mmt
+MULTI_METHOD_WITH_POLICY(encounter_compare, compare_dispatch, string, const virtual_<Animal>&, const virtual_<Animal>&);
+
+BEGIN_SPECIALIZATION(encounter_compare, string, const Animal&, const Animal&) {
+  return "ignore";
+} END_SPECIALIZATION;
+
+BEGIN_SPECIALIZATION(encounter_compare, string, const Herbivore&, const Carnivore&) {
+  return "run";
+} END_SPECIALIZATION;
+
+BEGIN_SPECIALIZATION(encounter_compare, string, const Carnivore&, const Herbivore&) {
+  return "hunt";
+} END_SPECIALIZATION;
+
+BEGIN_SPECIALIZATION(encounter_compare, string, const Carnivore&, const Carnivore&) {
+  return "fight";
+} END_SPECIALIZATION;
+
+struct Coin : selector {
+  MM_CLASS(Coin);
+  Coin() {
+    MM_INIT();
+  }
+};
+
+struct Heads : Coin {
+  MM_CLASS(Heads, Coin);
+  Heads() {
+    MM_INIT();
+  }
+};
+
+struct Tails : Coin {
+  MM_CLASS(Tails, Coin);
+  Tails() {
+    MM_INIT();
+  }
+};
+
+MULTI_METHOD_WITH_POLICY(face, compare_dispatch, string, const virtual_<Coin>&);
+
+BEGIN_SPECIALIZATION(face, string, const Heads&) {
+  return "heads";
+} END_SPECIALIZATION;
+
+BEGIN_SPECIALIZATION(face, string, const Tails&) {
+  return "tails";
+} END_SPECIALIZATION;
+
+MULTI_METHOD_WITH_POLICY(toss, compare_dispatch, string, const virtual_<Coin>&, const virtual_<Coin>&);
+
+BEGIN_SPECIALIZATION(toss, string, const Coin&, const Coin&) {
+  return "mixed";
+} END_SPECIALIZATION;
+
+BEGIN_SPECIALIZATION(toss, string, const Heads&, const Heads&) {
+  return "two heads";
+} END_SPECIALIZATION;
+
+BEGIN_SPECIALIZATION(toss, string, const Tails&, const Tails&) {
+  return "two tails";
+} END_SPECIALIZATION;
+}
+
+namespace monomorphic {
+
+#include "animals.hpp"
+
+MULTI_METHOD(describe, string, const virtual_<Animal>&, int);
+
+BEGIN_SPECIALIZATION(describe, string, const Animal&, int legs) {
+  return "animal with " + to_string(legs) + " legs";
+} END_SPECIALIZATION;
+
+MULTI_METHOD(pair_up, string, const virtual_<Animal>&, const virtual_<Animal>&);
+
+BEGIN_SPECIALIZATION(pair_up, string, const Animal&, const Animal&) {
+  return "pair";
+} END_SPECIALIZATION;
+
+// not monomorphic: calls with an Animal or a Carnivore must throw
+MULTI_METHOD(graze, string, const virtual_<Animal>&);
+
+BEGIN_SPECIALIZATION(graze, string, const Herbivore&) {
+  return "graze";
+} END_SPECIALIZATION;
+}
+
+namespace incremental_init {
+
+#include "animals.hpp"
+
+MULTI_METHOD(describe, string, const virtual_<Animal>&);
+
+BEGIN_SPECIALIZATION(describe, string, const Animal&) {
+  return "animal";
+} END_SPECIALIZATION;
+
+BEGIN_SPECIALIZATION(describe, string, const Carnivore&) {
+  return "carnivore";
+} END_SPECIALIZATION;
+
+MULTI_METHOD(feed, string, const virtual_<Herbivore>&);
+
+BEGIN_SPECIALIZATION(feed, string, const Herbivore&) {
+  return "grass";
+} END_SPECIALIZATION;
+}
+
 #if !defined(__clang__) && !defined(_MSC_VER)
 
+namespace early_objects {
+
+struct Gadget : selector {
+  MM_CLASS(Gadget);
+  Gadget() { MM_INIT(); }
+};
+
+struct Widget : Gadget {
+  MM_CLASS(Widget, Gadget);
+  Widget() { MM_INIT(); }
+};
+
+#define EARLY_METHOD(NAME, VALUE)                                       \
+  MULTI_METHOD(NAME, int, const virtual_<Gadget>&);                     \
+  BEGIN_SPECIALIZATION(NAME, int, const Gadget&) {                      \
+    return VALUE;                                                       \
+  } END_SPECIALIZATION;                                                 \
+  BEGIN_SPECIALIZATION(NAME, int, const Widget&) {                      \
+    return -VALUE;                                                      \
+  } END_SPECIALIZATION
+
+EARLY_METHOD(g0, 10);
+EARLY_METHOD(g1, 11);
+EARLY_METHOD(g2, 12);
+EARLY_METHOD(g3, 13);
+EARLY_METHOD(g4, 14);
+EARLY_METHOD(g5, 15);
+
+#undef EARLY_METHOD
+
+// constructed before the first initialize(), which adds slots to their
+// tables
+Gadget early_gadget;
+Widget early_widget;
+}
+
 namespace init_tests {
 
 #include "animals.hpp"
@@ -359,6 +567,17 @@ namespace adjust_virtual {
 #define VIRTUAL virtual
 #include "adjust.hpp"
 #undef VIRTUAL
+
+struct Other {
+  virtual ~Other() { }
+  int other;
+};
+
+// not registered, thus shares the table of B, but its X and its B sit
+// elsewhere
+struct Unregistered : Other, B {
+  char more[100];
+};
 }
 
 namespace multi_roots {
@@ -432,6 +651,9 @@ struct XY : X, Y {
 
 MM_FOREIGN_CLASS(XY, X, Y);
 
+struct Unregistered : X {
+};
+
 MULTI_METHOD(mx, int, const virtual_<X>&);
 
 BEGIN_SPECIALIZATION(mx, int, const X& x) {
@@ -450,6 +672,338 @@ BEGIN_SPECIALIZATION(mxy, int, const XY& xy) {
   return xy.x + xy.y;
 } END_SPECIALIZATION;
 
+MULTI_METHOD(kind, string, const virtual_<X>&);
+
+BEGIN_SPECIALIZATION(kind, string, const X&) {
+  return "X";
+} END_SPECIALIZATION;
+
+BEGIN_SPECIALIZATION(kind, string, const XY&) {
+  return "XY";
+} END_SPECIALIZATION;
+
+}
+
+namespace all_pairs {
+
+struct Body : selector {
+  MM_CLASS(Body);
+  Body() {
+    MM_INIT();
+  }
+};
+
+struct Rock : Body {
+  MM_CLASS(Rock, Body);
+  Rock(int id = 0) : id(id) {
+    MM_INIT();
+  }
+  int id;
+};
+
+struct Ship : Body {
+  MM_CLASS(Ship, Body);
+  Ship() {
+    MM_INIT();
+  }
+};
+
+MULTI_METHOD(collide, void, virtual_<Body>&, virtual_<Body>&, vector<string>& log);
+
+BEGIN_SPECIALIZATION(collide, void, Body&, Body&, vector<string>& log) {
+  log.push_back("pass");
+} END_SPECIALIZATION;
+
+BEGIN_SPECIALIZATION(collide, void, Rock&, Rock&, vector<string>& log) {
+  log.push_back("bounce");
+} END_SPECIALIZATION;
+
+BEGIN_SPECIALIZATION(collide, void, Ship&, Rock&, vector<string>& log) {
+  log.push_back("kaboom");
+} END_SPECIALIZATION;
+
+BEGIN_SPECIALIZATION(collide, void, Rock&, Ship&, vector<string>& log) {
+  log.push_back("kaboom");
+} END_SPECIALIZATION;
+
+MULTI_METHOD(update, void, virtual_<Body>&, int step, vector<string>& log);
+
+BEGIN_SPECIALIZATION(update, void, Body&, int step, vector<string>& log) {
+  log.push_back("body " + to_string(step));
+} END_SPECIALIZATION;
+
+BEGIN_SPECIALIZATION(update, void, Rock& rock, int step, vector<string>& log) {
+  log.push_back(to_string(rock.id) + " rock " + to_string(step));
+} END_SPECIALIZATION;
+
+// calls for_each from the targets of for_each
+MULTI_METHOD(update_all, void, virtual_<Body>&, vector<Body*>& bodies, vector<string>& log);
+
+BEGIN_SPECIALIZATION(update_all, void, Body&, vector<Body*>& bodies, vector<string>& log) {
+  update.for_each(bodies.begin(), bodies.end(), 1, log);
+} END_SPECIALIZATION;
+
+MULTI_METHOD(mass, int, const virtual_<Body>&, int scale);
+
+BEGIN_SPECIALIZATION(mass, int, const Rock& rock, int scale) {
+  return rock.id * scale;
+} END_SPECIALIZATION;
+
+BEGIN_SPECIALIZATION(mass, int, const Ship&, int scale) {
+  return 1000 * scale;
+} END_SPECIALIZATION;
+
+// calls parallel_reduce from the threads of parallel_reduce
+MULTI_METHOD(total_mass, int, const virtual_<Body>&, const vector<const Body*>& bodies);
+
+BEGIN_SPECIALIZATION(total_mass, int, const Body&, const vector<const Body*>& bodies) {
+  return mass.parallel_reduce(bodies.begin(), bodies.end(), 0, plus<int>(), 1);
+} END_SPECIALIZATION;
+
+MULTI_METHOD(tally, void, virtual_<Body>&, atomic<int>& rocks, atomic<int>& ships);
+
+BEGIN_SPECIALIZATION(tally, void, Rock&, atomic<int>& rocks, atomic<int>&) {
+  ++rocks;
+} END_SPECIALIZATION;
+
+BEGIN_SPECIALIZATION(tally, void, Ship&, atomic<int>&, atomic<int>& ships) {
+  ++ships;
+} END_SPECIALIZATION;
+
+string sorted(vector<string> log) {
+  sort(log.begin(), log.end());
+  ostringstream os;
+  for (auto& entry : log) {
+    os << entry << " ";
+  }
+  return os.str();
+}
+}
+
+namespace batch_specs {
+
+using all_pairs::Body;
+using all_pairs::Rock;
+using all_pairs::Ship;
+
+MULTI_METHOD(drift, void, virtual_<Body>&, int step, vector<string>& log);
+
+BEGIN_SPECIALIZATION(drift, void, Body&, int step, vector<string>& log) {
+  log.push_back("body " + to_string(step));
+} END_SPECIALIZATION;
+
+BEGIN_SPECIALIZATION(drift, void, Rock& rock, int step, vector<string>& log) {
+  log.push_back(to_string(rock.id) + " rock " + to_string(step));
+} END_SPECIALIZATION;
+
+BEGIN_SPECIALIZATION(drift, void, Ship&, int step, vector<string>& log) {
+  log.push_back("ship " + to_string(step));
+} END_SPECIALIZATION;
+
+BEGIN_BATCH_SPECIALIZATION(drift, void, span<Ship*> ships, int step, vector<string>& log) {
+  log.push_back(to_string(ships.size()) + " ships " + to_string(step));
+} END_SPECIALIZATION;
+
+BEGIN_BATCH_SPECIALIZATION(drift, void, span<Body*> bodies, int step, vector<string>& log) {
+  log.push_back(to_string(bodies.size()) + " bodies " + to_string(step));
+} END_SPECIALIZATION;
+
+}
+
+namespace tagged_foreign {
+
+enum kind { shape_kind, circle_kind, square_kind, triangle_kind };
+
+struct Shape {
+  Shape(kind k = shape_kind) : k(k) { }
+  virtual ~Shape() { }
+  kind k;
+};
+
+struct Circle : Shape {
+  Circle() : Shape(circle_kind) { }
+};
+
+struct Square : Shape {
+  Square() : Shape(square_kind) { }
+};
+
+struct Triangle : Shape {
+  Triangle() : Shape(triangle_kind) { }
+};
+
+MM_FOREIGN_TAGGED_ROOT(Shape, &Shape::k);
+
+MM_FOREIGN_CLASS(Shape);
+MM_FOREIGN_CLASS_TAG(Shape, shape_kind);
+MM_FOREIGN_CLASS(Circle, Shape);
+MM_FOREIGN_CLASS_TAG(Circle, circle_kind);
+MM_FOREIGN_CLASS(Square, Shape);
+MM_FOREIGN_CLASS_TAG(Square, square_kind);
+MM_FOREIGN_CLASS(Triangle, Shape); // no tag, dispatched via typeid
+
+MULTI_METHOD(name, string, const virtual_<Shape>&);
+
+BEGIN_SPECIALIZATION(name, string, const Shape&) {
+  return "shape";
+} END_SPECIALIZATION;
+
+BEGIN_SPECIALIZATION(name, string, const Circle&) {
+  return "circle";
+} END_SPECIALIZATION;
+
+BEGIN_SPECIALIZATION(name, string, const Square&) {
+  return "square";
+} END_SPECIALIZATION;
+
+BEGIN_SPECIALIZATION(name, string, const Triangle&) {
+  return "triangle";
+} END_SPECIALIZATION;
+
+MULTI_METHOD(same, bool, const virtual_<Shape>&, const virtual_<Shape>&);
+
+BEGIN_SPECIALIZATION(same, bool, const Shape&, const Shape&) {
+  return false;
+} END_SPECIALIZATION;
+
+BEGIN_SPECIALIZATION(same, bool, const Circle&, const Circle&) {
+  return true;
+} END_SPECIALIZATION;
+
+}
+
+namespace sealed_shapes {
+
+struct Shape : selector {
+  MM_CLASS(Shape);
+  Shape() {
+    MM_INIT();
+  }
+};
+
+struct Circle : Shape {
+  MM_CLASS(Circle, Shape);
+  Circle() {
+    MM_INIT();
+  }
+};
+
+struct Square : Shape {
+  MM_CLASS(Square, Shape);
+  Square() {
+    MM_INIT();
+  }
+};
+
+struct Unlisted : Shape {
+  MM_CLASS(Unlisted, Shape);
+  Unlisted() {
+    MM_INIT();
+  }
+};
+
+using shapes = sealed<Shape, Circle, Square>;
+
+BEGIN_SEALED_SPECIALIZATION(circle_sides, int, const Circle&, int factor) {
+  return 0 * factor;
+} END_SPECIALIZATION;
+
+BEGIN_SEALED_SPECIALIZATION(square_sides, int, const Square&, int factor) {
+  return 4 * factor;
+} END_SPECIALIZATION;
+
+const sealed_multi_method<
+  shapes, int(const virtual_<Shape>&, int), circle_sides, square_sides> sides;
+
+BEGIN_SEALED_SPECIALIZATION(shape_shape, string, const Shape&, const Shape&) {
+  return "shape-shape";
+} END_SPECIALIZATION;
+
+BEGIN_SEALED_SPECIALIZATION(circle_shape, string, const Circle&, const Shape&) {
+  return "circle-shape";
+} END_SPECIALIZATION;
+
+BEGIN_SEALED_SPECIALIZATION(shape_circle, string, const Shape&, const Circle&) {
+  return "shape-circle";
+} END_SPECIALIZATION;
+
+const sealed_multi_method<
+  shapes, string(const virtual_<Shape>&, const virtual_<Shape>&),
+  shape_shape, circle_shape, shape_circle> intersect;
+
+struct Polygon : selector {
+  MM_CLASS(Polygon);
+  Polygon() {
+    MM_INIT();
+  }
+};
+
+struct Triangle : Polygon {
+  MM_CLASS(Triangle, Polygon);
+  Triangle() {
+    MM_INIT();
+  }
+};
+
+BEGIN_SEALED_SPECIALIZATION(polygon_corners, int, const Polygon&) {
+  return 0;
+} END_SPECIALIZATION;
+
+BEGIN_SEALED_SPECIALIZATION(triangle_corners, int, const Triangle&) {
+  return 3;
+} END_SPECIALIZATION;
+
+const sealed_multi_method<
+  sealed<Polygon, Triangle>, int(const virtual_<Polygon>&),
+  polygon_corners, triangle_corners> corners;
+
+// called during static initialization, maybe before the indexes are stored
+int corners_at_startup = corners(Triangle());
+}
+
+namespace final_classes {
+
+struct Animal : selector {
+  MM_CLASS(Animal);
+  Animal() {
+    MM_INIT();
+  }
+};
+
+struct Dog final : Animal {
+  MM_CLASS(Dog, Animal);
+  Dog() {
+    MM_INIT();
+  }
+};
+
+struct Cat : Animal {
+  MM_CLASS(Cat, Animal);
+  Cat() {
+    MM_INIT();
+  }
+};
+
+struct Lion final : Cat {
+  MM_CLASS(Lion, Cat);
+  Lion() {
+    MM_INIT();
+  }
+};
+
+MULTI_METHOD(meet, string, const virtual_<Animal>&, const virtual_<Animal>&, int);
+
+BEGIN_SPECIALIZATION(meet, string, const Animal&, const Animal&, int times) {
+  return "ignore " + to_string(times);
+} END_SPECIALIZATION;
+
+BEGIN_SPECIALIZATION(meet, string, const Dog&, const Cat&, int times) {
+  return "chase " + to_string(times);
+} END_SPECIALIZATION;
+
+BEGIN_SPECIALIZATION(meet, string, const Cat&, const Dog&, int times) {
+  return "run " + to_string(times);
+} END_SPECIALIZATION;
 }
 
 namespace repeated {
@@ -585,7 +1139,8 @@ int main() {
 
     for (int n : { numeric_limits<unsigned long>::digits - 1,
             numeric_limits<unsigned long>::digits,
-            numeric_limits<unsigned long>::digits + 1 }) {
+            numeric_limits<unsigned long>::digits + 1,
+            128, 129 }) {
       cout << "n = " << n << endl;
 
       {
@@ -721,6 +1276,35 @@ int main() {
         test(v2[n - 2], true);
         test(v2[n - 1], false);
       }
+
+      {
+        bitvec v(n);
+        v[n / 2] = 1;
+        v[n - 1] = 1;
+        test(v.count(), 2);
+        test(v.find_first(), n / 2);
+        test(v.find_next(n / 2), n - 1);
+        test(v.find_next(n - 1) == bitvec::npos, true);
+        bitvec v2(1);
+        and_into(v2, v, ~bitvec(n));
+        test(v2 == v, true);
+        bitvec v3(std::move(v2));
+        test(v3 == v, true);
+        test(v2.size(), 0);
+        v2 = std::move(v3);
+        test(v2 == v, true);
+      }
+    }
+
+    {
+      // bits 32 to 63 of a 64-bit word
+      bitvec v(64);
+      v[40] = 1;
+      test(v[8], false);
+      test(v[40], true);
+      test(v.count(), 1);
+      v[40] = 0;
+      test(v.none(), true);
     }
     {
       bitvec v(2);
@@ -752,6 +1336,45 @@ int main() {
     }
   }
 
+  {
+    cout << "\n--- Objects constructed before initialize()." << endl;
+
+    using namespace early_objects;
+    test( mm_class::of<Gadget>::the().mmt.size() >= 6, true );
+    test( early_gadget._get_yomm11_ptbl(), mm_class::of<Gadget>::the().mmt.data() );
+    test( early_widget._get_yomm11_ptbl(), mm_class::of<Widget>::the().mmt.data() );
+    test( g0(early_gadget), 10 );
+    test( g5(early_gadget), 15 );
+    test( g0(early_widget), -10 );
+    test( g5(early_widget), -15 );
+  }
+
+  {
+    cout << "\n--- mmt storage." << endl;
+
+    mm_class::table mmt;
+    mm_class::offset* early = mmt.data();
+    test( mmt.header().index, -1 );
+    mmt.header().index = 3;
+    mmt.resize(2);
+    test( mmt.data(), early );
+    mmt[1].index = 42;
+    // no object points at the storage yet, thus it can move
+    mmt.resize(100);
+    test( mmt.data() != early, true );
+    test( mmt.size(), 100 );
+    test( mmt[1].index, 42 );
+    test( mmt.header().index, 3 );
+
+    mm_class::offset* pinned = mmt.pin();
+    test( pinned, mmt.data() );
+    mmt.resize(50);
+    test( mmt.data(), pinned );
+    test( throws<runtime_error>([&]() { mmt.resize(1000); }), true );
+    test( mmt.data(), pinned );
+    test( mmt.size(), 50 );
+  }
+
   {
     cout << "\n--- Slot allocation." << endl;
 
@@ -782,15 +1405,31 @@ int main() {
     test( init.nodes[6], &mm_class::of<CD>::the() );
     test( init.nodes[7], &mm_class::of<Y>::the() );
 
-    init.make_masks();
-    testx( init.nodes[0]->mask, bitvec(8, binary("11111111")) ); // X
-    testx( init.nodes[1]->mask, bitvec(8, binary("01111110")) ); // A
-    testx( init.nodes[2]->mask, bitvec(8, binary("00010100")) ); // B
-    testx( init.nodes[3]->mask, bitvec(8, binary("01011000")) ); // C
-    testx( init.nodes[4]->mask, bitvec(8, binary("00010000")) ); // BC
-    testx( init.nodes[5]->mask, bitvec(8, binary("01100000")) ); // D
-    testx( init.nodes[6]->mask, bitvec(8, binary("01000000")) ); // CD
-    testx( init.nodes[7]->mask, bitvec(8, binary("10000000")) ); // Y
+    init.number_classes();
+    test( init.nodes[0]->low, 0 ); // X
+    test( init.nodes[0]->high, 7 );
+    test( init.nodes[1]->low, 1 ); // A
+    test( init.nodes[1]->high, 6 );
+    test( init.nodes[4]->low, 3 ); // BC, first base B
+    test( init.nodes[4]->extra_bases == vector<int> { 4 }, true ); // C
+    test( init.nodes[3]->extra_specs == vector<int> { 3 }, true );
+
+    auto conforming = [&](const mm_class* pc) {
+      unsigned long bits = 0;
+      for (size_t i = 0; i < init.nodes.size(); i++) {
+        bits |= (unsigned long) init.nodes[i]->conforms_to(*pc) << i;
+      }
+      return bits;
+    };
+
+    test( conforming(init.nodes[0]), binary("11111111") ); // X
+    test( conforming(init.nodes[1]), binary("01111110") ); // A
+    test( conforming(init.nodes[2]), binary("00010100") ); // B
+    test( conforming(init.nodes[3]), binary("01011000") ); // C
+    test( conforming(init.nodes[4]), binary("00010000") ); // BC
+    test( conforming(init.nodes[5]), binary("01100000") ); // D
+    test( conforming(init.nodes[6]), binary("01000000") ); // CD
+    test( conforming(init.nodes[7]), binary("10000000") ); // Y
 
     init.assign_slots();
     test(m_x.the().slots[0], 0);
@@ -887,41 +1526,15 @@ int main() {
 
     grouping_resolver rdisp(display.the());
 
-    methods animal_applicable;
-    rdisp.find_applicable(0, &mm_class::of<Animal>::the(), animal_applicable);
-    test( animal_applicable, methods { display.the().methods[4] } );
-
-    methods herbivore_applicable;
-    rdisp.find_applicable(0, &mm_class::of<Herbivore>::the(), herbivore_applicable);
-    test( herbivore_applicable, (methods { display.the().methods[0], display.the().methods[1], display.the().methods[4] } ));
-
-    methods cow_applicable;
-    rdisp.find_applicable(0, &mm_class::of<Cow>::the(), cow_applicable);
-    test( cow_applicable, (methods { display.the().methods[0], display.the().methods[1], display.the().methods[4] } ));
-
-    methods carnivore_applicable;
-    rdisp.find_applicable(0, &mm_class::of<Carnivore>::the(), carnivore_applicable);
-    test( carnivore_applicable, (methods { display.the().methods[2],  display.the().methods[3], display.the().methods[4] }) );
-
-    methods wolf_applicable;
-    rdisp.find_applicable(0, &mm_class::of<Wolf>::the(), wolf_applicable);
-    test( wolf_applicable, (methods { display.the().methods[2],  display.the().methods[3], display.the().methods[4] }) );
-
-    methods interface_applicable;
-    rdisp.find_applicable(1, &mm_class::of<Interface>::the(), interface_applicable);
-    test( interface_applicable, methods { } );
-
-    methods terminal_applicable;
-    rdisp.find_applicable(1, &mm_class::of<Terminal>::the(), terminal_applicable);
-    test( terminal_applicable, (methods { display.the().methods[0], display.the().methods[2] }) );
-
-    methods window_applicable;
-    rdisp.find_applicable(1, &mm_class::of<Window>::the(), window_applicable);
-    test( window_applicable, (methods { display.the().methods[1], display.the().methods[3] }) );
-
-    methods mobile_applicable;
-    rdisp.find_applicable(1, &mm_class::of<Mobile>::the(), mobile_applicable);
-    test( mobile_applicable, (methods { display.the().methods[4] }) );
+    // the specializations applicable to each group
+    auto& m = display.the().methods;
+    methods animal_applicable { m[4] };
+    methods herbivore_applicable { m[0], m[1], m[4] };
+    methods carnivore_applicable { m[2], m[3], m[4] };
+    methods interface_applicable { };
+    methods terminal_applicable { m[0], m[2] };
+    methods window_applicable { m[1], m[3] };
+    methods mobile_applicable { m[4] };
 
     // Animal = class_0
     // Herbivore = class_1
@@ -951,25 +1564,26 @@ int main() {
         test( rdisp.groups[1][2].methods, window_applicable) &&
         test( rdisp.groups[1][3].methods, mobile_applicable);
 
-    test(display.the().steps.size(), 2) &&
-        test(display.the().steps[0], 1) &&
-        test(display.the().steps[1], 3);
-
-    test( (*Animal()._yomm11_ptbl)[0].index, 0 );
-    test( (*Herbivore()._yomm11_ptbl)[0].index, 1 );
-    test( (*Cow()._yomm11_ptbl)[0].index, 1 );
-    test( (*Carnivore()._yomm11_ptbl)[0].index, 2 );
-    test( (*Wolf()._yomm11_ptbl)[0].index, 2 );
-    test( (*Tiger()._yomm11_ptbl)[0].index, 2 );
-    test( (*Interface()._yomm11_ptbl).size(), 1 );
-    test( (*Interface()._yomm11_ptbl)[0].index, 0 );
-    test( (*Terminal()._yomm11_ptbl)[0].index, 1 );
-    test( (*Window()._yomm11_ptbl)[0].index, 2 );
-    test( (*MSWindows()._yomm11_ptbl)[0].index, 2 );
-    test( (*X()._yomm11_ptbl)[0].index, 2 );
-    test( (*Mobile()._yomm11_ptbl)[0].index, 3 );
-    test( (*Nokia()._yomm11_ptbl)[0].index, 3 );
-    test( (*Samsung()._yomm11_ptbl)[0].index, 3 );
+    test(display.the().slots_strides, decltype(display)::dispatch.slots_strides) &&
+        test(display.the().slots_strides[1], 1) &&
+        test(display.the().slots_strides[3], 3);
+
+    test( Animal()._get_yomm11_ptbl()[0].index, 0 );
+    test( Herbivore()._get_yomm11_ptbl()[0].index, 1 );
+    test( Cow()._get_yomm11_ptbl()[0].index, 1 );
+    test( Carnivore()._get_yomm11_ptbl()[0].index, 2 );
+    test( Wolf()._get_yomm11_ptbl()[0].index, 2 );
+    test( Tiger()._get_yomm11_ptbl()[0].index, 2 );
+    test( Interface()._get_yomm11_ptbl(), mm_class::of<Interface>::the().mmt.data() );
+    test( mm_class::of<Interface>::the().mmt.size(), 1 );
+    test( Interface()._get_yomm11_ptbl()[0].index, 0 );
+    test( Terminal()._get_yomm11_ptbl()[0].index, 1 );
+    test( Window()._get_yomm11_ptbl()[0].index, 2 );
+    test( MSWindows()._get_yomm11_ptbl()[0].index, 2 );
+    test( X()._get_yomm11_ptbl()[0].index, 2 );
+    test( Mobile()._get_yomm11_ptbl()[0].index, 3 );
+    test( Nokia()._get_yomm11_ptbl()[0].index, 3 );
+    test( Samsung()._get_yomm11_ptbl()[0].index, 3 );
 
     rdisp.make_table();
     auto table = display.the().dispatch_table;
@@ -1058,6 +1672,46 @@ int main() {
     test(encounter_specialization<string(Wolf&, Wolf&)>::next(w, w), "fight");
     test(encounter_specialization<string(Carnivore&, Carnivore&)>::next(w, w), "hunt");
     test(encounter_specialization<string(Carnivore&, Animal&)>::next(w, w), "ignore");
+
+    // call site cache
+    remove_const<decltype(encounter)>::type::call_site site = {};
+    test(site(c, w), "run");
+    test(site.generation, multi_method_base::generation);
+    test(site(c, w), "run");
+    test(site(w, w), "wag tail");
+    test(site(t, c), "hunt");
+    site.generation = 0;
+    test(site(c, w), "run");
+
+    for (int i = 0; i < 2; ++i) {
+      test(MM_CACHED_CALL(encounter, w, c), "hunt");
+      test(MM_CACHED_CALL(encounter, w, w), "wag tail");
+    }
+
+    // resolved handles
+    auto hunt = encounter.resolve(w, c);
+    test(hunt.valid(), true);
+    test(hunt(w, c), "hunt");
+    auto copy = hunt;
+    test(copy(w, c), "hunt");
+    test(encounter.resolve(c, w)(c, w), "run");
+    hunt.generation = 0;
+    test(hunt.valid(), false);
+    test(hunt(w, w), "wag tail");
+
+    // prefetching has no visible effect
+    encounter.prefetch(w, c);
+    display.prefetch(w, term);
+    test(encounter(w, c), "hunt");
+
+    // bound first argument
+    auto wolf_meets = encounter.bind(w);
+    test(wolf_meets.valid(), true);
+    test(wolf_meets(c), "hunt");
+    test(wolf_meets(w), "wag tail");
+    test(encounter.bind(c)(w), "run");
+    wolf_meets.generation = 0;
+    test(wolf_meets(c), "hunt");
   }
 
   cout << "\n--- multiple inheritance" << endl;
@@ -1099,7 +1753,6 @@ int main() {
     a.val = 2;
     B b;
     b.val = 5;
-    X& xa = a;
     X& xb = b;
 
     test( (&cast<A, A>::value(a)), &a);
@@ -1194,6 +1847,33 @@ int main() {
     test( foo(a, a), 4 );
     test( foo(a, b), -3 );
     test( foo(b, b), 25 );
+
+    // the offset is remembered in the table of the class
+    int id = cast<X, B>::id;
+    test( id > 0 && id <= mm_class::adjustment_count, true );
+    const mm_class::adjustment& known = mm_class::of<B>::the().mmt.adjustments()[id];
+    X& xb = b;
+    test( (&cast<X, B>::value(xb)), &b );
+    test( known.type.load() == &typeid(B), true );
+    test( known.offset.load(), 0 );
+    B b2;
+    X& xb2 = b2;
+    test( (&cast<X, B>::value(xb2)), &b2 );
+    const X& cxb2 = b2;
+    test( (&cast<X, B>::value(cxb2)), &b2 );
+
+    // a dynamic type that is not the one remembered: dynamic_cast
+    Unregistered u;
+    u.val = 3;
+    X& xu = u;
+    test( xu._get_yomm11_ptbl(), mm_class::of<B>::the().mmt.data() );
+    test( (char*) static_cast<B*>(&u) - (char*) &xu != (char*) &b - (char*) &xb, true );
+    test( (&cast<X, B>::value(xu)), static_cast<B*>(&u) );
+    const X& cxu = u;
+    test( (&cast<X, B>::value(cxu)), static_cast<B*>(&u) );
+    test( known.type.load() == &typeid(B), true );
+    test( foo(a, u), -1 );
+    test( foo(u, u), 9 );
   }
 
   {
@@ -1206,6 +1886,10 @@ int main() {
 
     test( xy.X::_yomm11_ptbl == xy.Y::_yomm11_ptbl, true );
 
+    // unary: the mmt holds the target
+    test( mm_class::of<XY>::the().mmt[decltype(mx)::dispatch.slots_strides[0]].pf ==
+          reinterpret_cast<void (*)()>(GET_SPECIALIZATION(mx, int, const X&)), true );
+
     test( mx(xy), 1 );
     test( my(xy), 2 );
     test( mxy(xy), 3 );
@@ -1215,6 +1899,12 @@ int main() {
     cout << "\n--- Multiple roots - foreign." << endl;
     using namespace multi_roots_foreign;
 
+    using foreign = get_mm_table<false>;
+    test( foreign::hash_table[foreign::hash(typeid(X))].key, &typeid(X) );
+    test( foreign::hash_table[foreign::hash(typeid(Y))].key, &typeid(Y) );
+    test( foreign::hash_table[foreign::hash(typeid(XY))].key, &typeid(XY) );
+    test( foreign::hash_table[foreign::hash(typeid(XY))].mmt, mm_class::of<XY>::the().mmt.data() );
+
     XY xy;
     xy.x = 1;
     xy.y = 2;
@@ -1222,6 +1912,41 @@ int main() {
     test( mx(xy), 1 );
     test( my(xy), 2 );
     test( mxy(xy), 3 );
+
+    Unregistered unregistered;
+    test( kind(xy), "XY" );
+    test( throws<runtime_error>([&]() { kind(unregistered); }), true );
+
+    // mx has a single specialization, thus is called directly
+    test( throws<runtime_error>([&]() { mx.resolve(unregistered); }), true );
+#ifndef NDEBUG
+    test( throws<runtime_error>([&]() { mx(unregistered); }), true );
+#endif
+  }
+
+  {
+    cout << "\n--- Foreign - tagged." << endl;
+    using namespace tagged_foreign;
+
+    static_assert(is_tagged<Shape>::value, "Shape is tagged");
+    static_assert(is_tagged<Circle>::value, "Circle is tagged");
+    static_assert(!is_tagged<multi_roots_foreign::X>::value, "X is not tagged");
+
+    Shape shape;
+    Circle circle;
+    Square square;
+    Triangle triangle;
+
+    test( get_tagged_mm_table::value(&circle), mm_class::of<Circle>::the().mmt.data() );
+    test( get_tagged_mm_table::value(&triangle), mm_class::of<Triangle>::the().mmt.data() );
+    test( class_tag<Shape>::table.size, 3 );
+
+    test( name(shape), "shape" );
+    test( name(circle), "circle" );
+    test( name(square), "square" );
+    test( name(triangle), "triangle" );
+    test( same(circle, circle), true );
+    test( same(circle, square), false );
   }
 
   {
@@ -1245,6 +1970,476 @@ int main() {
     test( mx(b), 17 );
   }
 
+  {
+    cout << "\n--- All pairs." << endl;
+    using namespace all_pairs;
+
+    Rock rock, rock2;
+    Ship ship, ship2;
+    Body body;
+    vector<string> log;
+
+    Body* left[] = { &ship, &rock, &rock2 };
+    Body* right[] = { &rock, &ship };
+    collide.for_each_pair(begin(left), end(left), begin(right), end(right), log);
+    test( sorted(log), "bounce bounce kaboom kaboom kaboom pass " );
+
+    log.clear();
+    vector<Body*> bodies = { &rock, &ship, &rock2 };
+    collide.for_each_unordered_pair(bodies.begin(), bodies.end(), log);
+    test( sorted(log), "bounce kaboom kaboom " );
+
+    log.clear();
+    bodies = { &ship, &rock, &body, &ship2, &rock2 };
+    collide.for_each_unordered_pair(bodies.begin(), bodies.end(), log);
+    test( log.size(), 10 );
+    test( sorted(log), "bounce kaboom kaboom kaboom kaboom pass pass pass pass pass " );
+
+    log.clear();
+    collide.for_each_unordered_pair(bodies.begin(), bodies.begin() + 1, log);
+    collide.for_each_pair(bodies.begin(), bodies.begin(), bodies.begin(), bodies.end(), log);
+    test( log.size(), 0 );
+  }
+
+  {
+    cout << "\n--- Batch." << endl;
+    using namespace all_pairs;
+
+    Rock rock1(1), rock2(2), rock3(3);
+    Ship ship;
+    Body body;
+    vector<string> log;
+
+    Body* bodies[] = { &rock1, &ship, &rock2, &body, &rock3 };
+    update.for_each(begin(bodies), end(bodies), 7, log);
+    test( log.size(), 5 );
+    // buckets in order of first appearance, range order within a bucket
+    test( log[0], "1 rock 7" );
+    test( log[1], "2 rock 7" );
+    test( log[2], "3 rock 7" );
+    test( log[3], "body 7" );
+    test( log[4], "body 7" );
+
+    log.clear();
+    update.for_each(begin(bodies), begin(bodies), 7, log);
+    test( log.size(), 0 );
+
+    // a call from a target does not use the buffers of the outer call
+    vector<Body*> outer = { &ship, &rock1 }, inner = { &rock2, &body };
+    update_all.for_each(outer.begin(), outer.end(), inner, log);
+    test( log.size(), 4 );
+    test( sorted(log), "2 rock 1 2 rock 1 body 1 body 1 " );
+
+    {
+      detail::scratch<vector<int>> buffers;
+      buffers->assign(3, 0);
+      detail::scratch<vector<int>> nested;
+      test( &*nested != &*buffers, true );
+      test( nested->empty(), true );
+    }
+
+    // the next call in the thread gets the same buffers back, as they were
+    {
+      detail::scratch<vector<int>> buffers;
+      test( buffers->size(), 3 );
+    }
+  }
+
+  {
+    cout << "\n--- Batch specializations." << endl;
+    using namespace batch_specs;
+
+    Rock rock1(1), rock2(2), rock3(3);
+    Ship ship, ship2;
+    Body body;
+    vector<string> log;
+
+    Body* bodies[] = { &rock1, &ship, &rock2, &body, &rock3, &ship2 };
+    drift.for_each(begin(bodies), end(bodies), 7, log);
+    test( log.size(), 5 );
+    test( log[0], "1 rock 7" );
+    test( log[1], "2 rock 7" );
+    test( log[2], "3 rock 7" );
+    test( log[3], "2 ships 7" );
+    test( log[4], "1 bodies 7" );
+
+    // batch specializations replace scalar ones for the same class only
+    using drift_target = decltype(drift)::method_pointer_type;
+    test( drift.impl->batch_specs.size(), 2 );
+    test( drift.impl->batch_targets.size(), 2 );
+    int slot = drift.dispatch.slots_strides[0];
+    test( drift.impl->find_batch_spec(
+            reinterpret_cast<drift_target>(mm_class::of<Ship>::the().mmt[slot].pf)) != nullptr, true );
+    test( drift.impl->find_batch_spec(
+            reinterpret_cast<drift_target>(mm_class::of<Rock>::the().mmt[slot].pf)) == nullptr, true );
+  }
+
+  {
+    cout << "\n--- Parallel." << endl;
+    using namespace all_pairs;
+
+    vector<Rock> rocks;
+    for (int i = 0; i < 1000; ++i) {
+      rocks.push_back(Rock(i));
+    }
+    Ship ship;
+
+    vector<const Body*> bodies;
+    vector<Body*> mutable_bodies;
+    for (auto& rock : rocks) {
+      bodies.push_back(&rock);
+      mutable_bodies.push_back(&rock);
+      if (rock.id % 10 == 0) {
+        bodies.push_back(&ship);
+        mutable_bodies.push_back(&ship);
+      }
+    }
+
+    test( mass.parallel_reduce(bodies.begin(), bodies.end(), 0, plus<int>(), 2),
+          2 * (999 * 1000 / 2 + 100 * 1000) );
+    test( mass.parallel_reduce(bodies.begin(), bodies.begin(), 0, plus<int>(), 2), 0 );
+
+    // the threads are reused
+    for (int i = 0; i < 10; ++i) {
+      test( mass.parallel_reduce(bodies.begin(), bodies.end(), 0, plus<int>(), i),
+            i * (999 * 1000 / 2 + 100 * 1000) );
+    }
+
+    vector<const Body*> nested(10, &ship);
+    test( total_mass.parallel_reduce(nested.begin(), nested.end(), 0, plus<int>(), bodies),
+          10 * (999 * 1000 / 2 + 100 * 1000) );
+
+    atomic<int> rock_count(0), ship_count(0);
+    tally.parallel_for_each(mutable_bodies.begin(), mutable_bodies.end(), rock_count, ship_count);
+    test( rock_count.load(), 1000 );
+    test( ship_count.load(), 100 );
+
+    // a caller in another thread waits for the pool
+    int in_main = 0, in_other = 0;
+    thread other([&]() {
+        in_other = mass.parallel_reduce(bodies.begin(), bodies.end(), 0, plus<int>(), 3);
+      });
+    in_main = total_mass.parallel_reduce(nested.begin(), nested.end(), 0, plus<int>(), bodies);
+    other.join();
+    test( in_main, 10 * (999 * 1000 / 2 + 100 * 1000) );
+    test( in_other, 3 * (999 * 1000 / 2 + 100 * 1000) );
+
+    // no specialization for Body
+    Body body;
+    bodies.push_back(&body);
+    test( throws<undefined>([&]() {
+          mass.parallel_reduce(bodies.begin(), bodies.end(), 0, plus<int>(), 1); }), true );
+  }
+
+  {
+    cout << "\n--- Sealed." << endl;
+    using namespace sealed_shapes;
+
+    Shape shape;
+    Circle circle;
+    Square square;
+    Unlisted unlisted;
+
+    test( mm_class::of<Shape>::the().mmt.header().index, 0 );
+    test( mm_class::of<Circle>::the().mmt.header().index, 1 );
+    test( mm_class::of<Square>::the().mmt.header().index, 2 );
+    test( mm_class::of<Unlisted>::the().mmt.header().index, -1 );
+
+    test( sides(circle, 3), 0 );
+    test( sides(square, 3), 12 );
+    test( throws<undefined>([&]() { sides(shape, 1); }), true );
+    test( throws<undefined>([&]() { sides(unlisted, 1); }), true );
+
+    test( intersect(shape, shape), "shape-shape" );
+    test( intersect(square, square), "shape-shape" );
+    test( intersect(circle, square), "circle-shape" );
+    test( intersect(square, circle), "shape-circle" );
+    test( throws<ambiguous>([&]() { intersect(circle, circle); }), true );
+    test( throws<undefined>([&]() { intersect(circle, unlisted); }), true );
+
+    // same cells as a dynamic table would hold
+    test( decltype(intersect)::size, 9 );
+    test( decltype(intersect)::table::value[2 * 3 + 2] == &shape_shape::body, true );
+
+    test( corners_at_startup, 3 );
+    test( corners(Polygon()), 0 );
+  }
+
+  {
+    cout << "\n--- Final classes." << endl;
+    using namespace final_classes;
+
+    struct Base { virtual ~Base() { } };
+    struct Derived final : virtual Base { };
+    struct Open : virtual Base { };
+    struct Left : Base { };
+    struct Right : Base { };
+    struct Twice final : Left, Right { };
+    test( bool(detail::is_virtual_base_of<Animal, Dog>::value), false );
+    test( bool(detail::is_virtual_base_of<Base, Derived>::value), true );
+    test( bool(detail::is_virtual_base_of<Base, Open>::value), true );
+    test( bool(detail::is_virtual_base_of<Base, Twice>::value), false );
+
+    Dog dog;
+    Lion lion;
+    Cat cat;
+    const Animal& animal = lion;
+
+    using dog_lion = decltype(meet)::final_call<Dog, Lion, int>;
+    test( dog_lion::target.load() == nullptr, true );
+    test( meet(dog, lion, 1), "chase 1" );
+    test( dog_lion::target.load() != nullptr, true );
+    test( meet(dog, lion, 2), "chase 2" );
+    test( meet(lion, dog, 3), "run 3" );
+    test( meet(dog, dog, 4), "ignore 4" );
+    test( meet(dog, cat, 5), "chase 5" );
+    test( meet(dog, animal, 6), "chase 6" );
+
+    // the objects are not read any more
+    Dog stray;
+    stray._yomm11_ptbl = nullptr;
+    test( meet(stray, lion, 7), "chase 7" );
+
+    // looked up again once the table is rebuilt
+    meet.the().invalidate();
+    initialize();
+    test( dog_lion::target.load() == nullptr, true );
+    test( meet(dog, lion, 8), "chase 8" );
+    test( dog_lion::target.load() != nullptr, true );
+  }
+
+  {
+    cout << "\n--- Dispatch policies." << endl;
+    using namespace dispatch_policies;
+
+    initialize();
+
+    // one column per class of the first dimension, instead of one per group
+    test( decltype(encounter)::dispatch.slots_strides[3], 3 );
+    test( decltype(encounter_dense)::dispatch.slots_strides[3], 6 );
+
+    Animal animal;
+    Herbivore herbivore;
+    Cow cow;
+    Carnivore carnivore;
+    Wolf wolf;
+    Tiger tiger;
+    vector<const Animal*> animals { &animal, &herbivore, &cow, &carnivore, &wolf, &tiger };
+
+    int same = 0;
+
+    for (auto a : animals) {
+      for (auto b : animals) {
+        same += encounter_dense(*a, *b) == encounter(*a, *b);
+      }
+    }
+
+    test( same, 36 );
+    test( encounter_dense(cow, tiger), "run" );
+    test( encounter_dense(wolf, cow), "hunt" );
+    test( encounter_dense(tiger, wolf), "fight" );
+    test( encounter_dense(cow, cow), "ignore" );
+
+    test( decltype(encounter_compare)::dispatch.keys[0].count, 0 );
+    same = 0;
+
+    for (auto a : animals) {
+      for (auto b : animals) {
+        same += encounter_compare(*a, *b) == encounter(*a, *b);
+      }
+    }
+
+    test( same, 36 );
+
+    // these read the table without the policy's lookup
+    same = 0;
+
+    for (auto a : animals) {
+      auto bound = encounter_compare.bind(*a);
+      for (auto b : animals) {
+        same += bound(*b) == encounter(*a, *b);
+      }
+    }
+
+    test( same, 36 );
+
+    test( decltype(face)::dispatch.keys[0].count, 3 );
+    test( decltype(toss)::dispatch.keys[0].count, 3 );
+    test( decltype(toss)::dispatch.keys[1].count, 3 );
+
+    Coin coin;
+    Heads heads;
+    Tails tails;
+
+    test( face(heads), "heads" );
+    test( face(tails), "tails" );
+    test( throws<undefined>([&]() { face(coin); }), true );
+    test( toss(heads, heads), "two heads" );
+    test( toss(tails, tails), "two tails" );
+    test( toss(heads, tails), "mixed" );
+    test( toss(tails, coin), "mixed" );
+    test( toss.resolve(heads, heads).target == toss.resolve(tails, tails).target, false );
+  }
+
+  {
+    cout << "\n--- Monomorphic multi-methods." << endl;
+    using namespace monomorphic;
+
+    initialize();
+
+    test( decltype(describe)::dispatch.direct != nullptr, true );
+    test( decltype(pair_up)::dispatch.direct != nullptr, true );
+    test( decltype(graze)::dispatch.direct == nullptr, true );
+    test( decltype(dispatch_policies::encounter)::dispatch.direct == nullptr, true );
+
+    Animal animal;
+    Cow cow;
+    Wolf wolf;
+
+    test( describe(cow, 4), "animal with 4 legs" );
+    test( describe(animal, 0), "animal with 0 legs" );
+    test( pair_up(cow, wolf), "pair" );
+    test( graze(cow), "graze" );
+    test( throws<undefined>([&]() { graze(wolf); }), true );
+    test( throws<undefined>([&]() { graze(animal); }), true );
+  }
+
+  {
+    cout << "\n--- Incremental initialization." << endl;
+    using namespace incremental_init;
+
+    initialize();
+    auto feed_table = feed.the().dispatch_table;
+
+    {
+      // a class added at run time, e.g. by a shared object
+      mm_class leopard;
+      leopard.initialize({ &mm_class::of<Carnivore>::the() });
+
+      // registration only queues the class
+      test( mm_class::to_invalidate->count(&leopard), 1 );
+      test( multi_method_base::to_initialize == nullptr, true );
+
+      mm_class::invalidate_methods();
+      test( mm_class::to_invalidate == nullptr, true );
+      test( multi_method_base::to_initialize->count(&describe.the()), 1 );
+      test( multi_method_base::to_initialize->count(&feed.the()), 0 );
+
+      initialize();
+      test( multi_method_base::to_initialize == nullptr, true );
+      test( feed.the().dispatch_table == feed_table, true );
+      test( reinterpret_cast<decltype(describe)::method_pointer_type>(
+              leopard.mmt[decltype(describe)::dispatch.slots_strides[0]].pf)(Wolf()),
+            "carnivore" );
+    }
+
+    test( mm_class::to_invalidate->count(&mm_class::of<Carnivore>::the()), 1 );
+    mm_class::invalidate_methods();
+    test( multi_method_base::to_initialize->count(&describe.the()), 1 );
+    test( multi_method_base::to_initialize->count(&feed.the()), 0 );
+
+    initialize();
+    test( feed.the().dispatch_table == feed_table, true );
+    test( describe(Tiger()), "carnivore" );
+    test( describe(Cow()), "animal" );
+    test( feed(Cow()), "grass" );
+  }
+
+  {
+    cout << "\n--- Registration order." << endl;
+    using namespace incremental_init;
+
+    {
+      // class templates can be registered before their bases
+      mm_class base, derived;
+      derived.initialize({ &base });
+      test( derived.root == nullptr, true );
+      base.initialize({ &mm_class::of<Animal>::the() });
+
+      initialize();
+      test( derived.root, &mm_class::of<Animal>::the() );
+      test( derived.conforms_to(base), true );
+      test( base.conforms_to(derived), false );
+    }
+
+    {
+      // a hierarchy that goes away, and a class that is never initialized
+      mm_class root, leaf, orphan;
+      root.initialize({});
+      leaf.initialize({ &root });
+      initialize();
+      test( leaf.conforms_to(root), true );
+    }
+
+    test( mm_class::to_initialize == nullptr, true );
+    initialize();
+    test( describe(Tiger()), "carnivore" );
+  }
+
+  {
+    cout << "\n--- Diamonds." << endl;
+
+    // 30 stacked diamonds: 2^30 paths from the root to the last class
+    runtime_classes classes;
+    classes.add({});
+
+    for (int level = 0; level < 30; level++) {
+      mm_class* top = classes.back().get();
+      mm_class* left = classes.add({ top });
+      mm_class* right = classes.add({ top });
+      classes.add({ left, right });
+    }
+
+    int visits = 0;
+    classes[0]->for_each_conforming([&](mm_class*) { ++visits; });
+    test( visits, 91 );
+
+    hierarchy_initializer init(*classes[0]);
+    init.collect_classes();
+    test( init.nodes.size(), 91 );
+    test( init.nodes.back(), classes.back().get() );
+
+    initialize();
+    test( classes.back()->conforms_to(*classes[0]), true );
+    test( classes[1]->conforms_to(*classes[2]), false );
+
+    // random multiple inheritance, checked against the transitive closure
+    // of the bases
+    mt19937 random;
+    runtime_classes dag;
+    dag.add({});
+    vector<vector<bool>> ancestors(200, vector<bool>(200));
+    ancestors[0][0] = true;
+
+    for (int i = 1; i < 200; i++) {
+      vector<mm_class*> bases;
+      ancestors[i][i] = true;
+
+      for (int n = random() % 3 + 1; n--; ) {
+        int base = random() % i;
+        if (find(bases.begin(), bases.end(), dag[base].get()) == bases.end()) {
+          bases.push_back(dag[base].get());
+          for (int j = 0; j < i; j++) {
+            ancestors[i][j] = ancestors[i][j] || ancestors[base][j];
+          }
+        }
+      }
+
+      dag.add(bases);
+    }
+
+    initialize();
+    int mismatches = 0;
+
+    for (int i = 0; i < 200; i++) {
+      for (int j = 0; j < 200; j++) {
+        mismatches += dag[i]->conforms_to(*dag[j]) != ancestors[i][j];
+      }
+    }
+
+    test( mismatches, 0 );
+  }
+
   cout << "\n" << success << " tests succeeded, " << failure << " failed.\n";
 
   return 0;